@@ -69,6 +69,12 @@ function litecoinzd_start {
                     exit 1
             esac
             ;;
+        peerconnections)
+            rm -rf "$DATADIR"
+            mkdir -p "$DATADIR/regtest"
+            # Leave room for up to 4000 loopback peers
+            echo "maxconnections=4100" > "$DATADIR/litecoinz.conf"
+            ;;
         *)
             rm -rf "$DATADIR"
             mkdir -p "$DATADIR/regtest"
@@ -165,7 +171,7 @@ fi
 case "$1" in
     *)
         case "$2" in
-            verifyjoinsplit)
+            verifyjoinsplit|verifyblockjoinsplits)
                 litecoinzd_start "${@:2}"
                 RAWJOINSPLIT=$(litecoinz_rpc zcsamplejoinsplit)
                 litecoinzd_stop
@@ -188,6 +194,9 @@ case "$1" in
             verifyjoinsplit)
                 litecoinz_rpc zcbenchmark verifyjoinsplit 1000 "\"$RAWJOINSPLIT\""
                 ;;
+            verifyblockjoinsplits)
+                litecoinz_rpc zcbenchmark verifyblockjoinsplits 10 "\"$RAWJOINSPLIT\"" "${@:3}"
+                ;;
             solveequihash)
                 litecoinz_rpc_slow zcbenchmark solveequihash 50 "${@:3}"
                 ;;
@@ -216,6 +225,36 @@ case "$1" in
             listunspent)
                 litecoinz_rpc zcbenchmark listunspent 10
                 ;;
+            buildindexes)
+                litecoinz_rpc zcbenchmark buildindexes 10 "${@:3}"
+                ;;
+            sigcache)
+                litecoinz_rpc zcbenchmark sigcache 10 "${@:3}"
+                ;;
+            indexlookupmisses)
+                litecoinz_rpc zcbenchmark indexlookupmisses 10
+                ;;
+            readblocks)
+                litecoinz_rpc zcbenchmark readblocks 10
+                ;;
+            readblockstrusted)
+                litecoinz_rpc zcbenchmark readblockstrusted 10
+                ;;
+            coinsmap)
+                litecoinz_rpc zcbenchmark coinsmap 10
+                ;;
+            coinsunorderedmap)
+                litecoinz_rpc zcbenchmark coinsunorderedmap 10
+                ;;
+            merkleroot)
+                litecoinz_rpc zcbenchmark merkleroot 10
+                ;;
+            acceptflood)
+                litecoinz_rpc zcbenchmark acceptflood 10 "${@:3}"
+                ;;
+            peerconnections)
+                litecoinz_rpc zcbenchmark peerconnections 3 "${@:3}"
+                ;;
             *)
                 litecoinzd_stop
                 echo "Bad arguments to time."
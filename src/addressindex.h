@@ -8,6 +8,20 @@
 
 #include "uint256.h"
 #include "amount.h"
+#include "serialize.h"
+
+/**
+ * Address types of the address index keys. Outputs that are not P2PKH or
+ * P2SH are indexed by the Hash160 of their full scriptPubKey, and the
+ * transparent value JoinSplits move into (vpub_old) and out of (vpub_new)
+ * the shielded pool is indexed under a null hash.
+ */
+enum AddressIndexType {
+    ADDRESSINDEX_PUBKEYHASH = 1,
+    ADDRESSINDEX_SCRIPTHASH = 2,
+    ADDRESSINDEX_SCRIPT     = 3,
+    ADDRESSINDEX_SPROUT     = 4,
+};
 
 struct CMempoolAddressDelta
 {
@@ -56,26 +70,38 @@ struct CMempoolAddressDeltaKey
     }
 };
 
-struct CMempoolAddressDeltaKeyCompare
-{
-    bool operator()(const CMempoolAddressDeltaKey& a, const CMempoolAddressDeltaKey& b) const {
-        if (a.type == b.type) {
-            if (a.addressBytes == b.addressBytes) {
-                if (a.txhash == b.txhash) {
-                    if (a.index == b.index) {
-                        return a.spending < b.spending;
-                    } else {
-                        return a.index < b.index;
-                    }
-                } else {
-                    return a.txhash < b.txhash;
-                }
-            } else {
-                return a.addressBytes < b.addressBytes;
-            }
-        } else {
-            return a.type < b.type;
-        }
+struct CAddressBalanceValue {
+    CAmount balance;
+    CAmount received;
+    int blockHeight; // height of the last block whose deltas are included
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(balance);
+        READWRITE(received);
+        READWRITE(blockHeight);
+    }
+
+    CAddressBalanceValue(CAmount balanceIn, CAmount receivedIn, int height) {
+        balance = balanceIn;
+        received = receivedIn;
+        blockHeight = height;
+    }
+
+    CAddressBalanceValue() {
+        SetNull();
+    }
+
+    void SetNull() {
+        balance = 0;
+        received = 0;
+        blockHeight = -1;
+    }
+
+    bool IsNull() const {
+        return (blockHeight == -1);
     }
 };
 
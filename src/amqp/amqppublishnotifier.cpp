@@ -152,8 +152,10 @@ bool AMQPPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
 {
     LogPrint("amqp", "amqp: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    {
+    // The new tip is normally still in memory
+    std::shared_ptr<const CDataStream> pssRecent = GetRecentBlockBytes(pindex->GetBlockHash());
+    CDataStream ssRead(SER_NETWORK, PROTOCOL_VERSION);
+    if (!pssRecent) {
         LOCK(cs_main);
         CBlock block;
         if(!ReadBlockFromDisk(block, pindex)) {
@@ -161,8 +163,9 @@ bool AMQPPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
             return false;
         }
 
-        ss << block;
+        ssRead << block;
     }
+    const CDataStream& ss = pssRecent ? *pssRecent : ssRead;
 
     return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
 }
@@ -12,6 +12,8 @@
 
 #include <assert.h>
 
+#include <new>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -66,6 +68,7 @@ bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveC
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 uint256 CCoinsViewBacked::GetBestAnchor() const { return base->GetBestAnchor(); }
 void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
+CCoinsView* CCoinsViewBacked::GetBackend() const { return base; }
 bool CCoinsViewBacked::BatchWrite(CCoinsMap &mapCoins,
                                   const uint256 &hashBlock,
                                   const uint256 &hashAnchor,
@@ -75,6 +78,133 @@ bool CCoinsViewBacked::GetStats(CCoinsStats &stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
+CCoinsMap::CCoinsMap() : salt(GetRandHash()), nSize(0), nDeleted(0), nChunkUsed(0), pfree(NULL) { }
+
+CCoinsMap::~CCoinsMap()
+{
+    clear();
+}
+
+size_t CCoinsMap::FindSlot(const uint256& key) const
+{
+    if (vSlots.empty())
+        return 0;
+    uint64_t hash = Hash(key);
+    uint32_t nTag = Tag(hash);
+    size_t nMask = vSlots.size() - 1;
+    for (size_t i = hash & nMask; ; i = (i + 1) & nMask) {
+        const Slot& slot = vSlots[i];
+        if (slot.nTag == TAG_EMPTY)
+            return vSlots.size();
+        if (slot.nTag == nTag && slot.pvalue->first == key)
+            return i;
+    }
+}
+
+void CCoinsMap::Rehash(size_t nSlots)
+{
+    std::vector<Slot> vOld(nSlots);
+    vOld.swap(vSlots);
+    nDeleted = 0;
+    size_t nMask = nSlots - 1;
+    for (size_t j = 0; j < vOld.size(); j++) {
+        if (vOld[j].nTag <= TAG_DELETED)
+            continue;
+        size_t i = Hash(vOld[j].pvalue->first) & nMask;
+        while (vSlots[i].nTag != TAG_EMPTY)
+            i = (i + 1) & nMask;
+        vSlots[i] = vOld[j];
+    }
+}
+
+CCoinsMap::value_type* CCoinsMap::AllocateEntry()
+{
+    if (pfree != NULL) {
+        void* p = pfree;
+        pfree = *static_cast<void**>(p);
+        return static_cast<value_type*>(p);
+    }
+    if (vChunks.empty() || nChunkUsed == vChunks.back().second) {
+        size_t nEntries = vChunks.empty() ? MIN_CHUNK_ENTRIES : std::min(vChunks.back().second * 2, MAX_CHUNK_ENTRIES);
+        vChunks.push_back(std::make_pair(static_cast<char*>(::operator new(nEntries * sizeof(value_type))), nEntries));
+        nChunkUsed = 0;
+    }
+    return reinterpret_cast<value_type*>(vChunks.back().first + sizeof(value_type) * nChunkUsed++);
+}
+
+void CCoinsMap::FreeEntry(value_type* pvalue)
+{
+    pvalue->~value_type();
+    *reinterpret_cast<void**>(pvalue) = pfree;
+    pfree = pvalue;
+}
+
+std::pair<CCoinsMap::iterator, bool> CCoinsMap::insert(const value_type& value)
+{
+    // Keep at most 3/4 of the slots used or deleted so probe sequences stay
+    // short; rehashing also drops the deleted slots
+    if ((nSize + nDeleted + 1) * 4 > vSlots.size() * 3) {
+        size_t nSlots = MIN_SLOTS;
+        while (nSlots < (nSize + 1) * 2)
+            nSlots *= 2;
+        Rehash(nSlots);
+    }
+
+    uint64_t hash = Hash(value.first);
+    uint32_t nTag = Tag(hash);
+    size_t nMask = vSlots.size() - 1;
+    size_t nFree = vSlots.size();
+    size_t i = hash & nMask;
+    for (; vSlots[i].nTag != TAG_EMPTY; i = (i + 1) & nMask) {
+        if (vSlots[i].nTag == nTag && vSlots[i].pvalue->first == value.first)
+            return std::make_pair(iterator(this, i, vSlots[i].pvalue), false);
+        if (vSlots[i].nTag == TAG_DELETED && nFree == vSlots.size())
+            nFree = i;
+    }
+    if (nFree != vSlots.size()) {
+        i = nFree;
+        nDeleted--;
+    }
+
+    value_type* pvalue = AllocateEntry();
+    new (pvalue) value_type(value);
+    vSlots[i].nTag = nTag;
+    vSlots[i].pvalue = pvalue;
+    nSize++;
+    return std::make_pair(iterator(this, i, pvalue), true);
+}
+
+void CCoinsMap::erase(iterator it)
+{
+    // The slot of an entry moves when an insert rehashes the table
+    size_t nSlot = it.nSlot;
+    if (nSlot >= vSlots.size() || vSlots[nSlot].pvalue != it.pvalue)
+        nSlot = FindSlot(it->first);
+    assert(nSlot < vSlots.size());
+
+    FreeEntry(vSlots[nSlot].pvalue);
+    vSlots[nSlot].nTag = TAG_DELETED;
+    vSlots[nSlot].pvalue = NULL;
+    nSize--;
+    nDeleted++;
+}
+
+void CCoinsMap::clear()
+{
+    for (size_t i = 0; i < vSlots.size(); i++) {
+        if (vSlots[i].nTag > TAG_DELETED)
+            vSlots[i].pvalue->~value_type();
+    }
+    for (size_t i = 0; i < vChunks.size(); i++)
+        ::operator delete(vChunks[i].first);
+    std::vector<Slot>().swap(vSlots);
+    std::vector<std::pair<char*, size_t> >().swap(vChunks);
+    nSize = 0;
+    nDeleted = 0;
+    nChunkUsed = 0;
+    pfree = NULL;
+}
+
 CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
 
 CCoinsViewCache::~CCoinsViewCache()
@@ -233,6 +363,43 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
+bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
+    return cacheCoins.find(txid) != cacheCoins.end();
+}
+
+bool CCoinsViewCache::HaveAnchorInCache(const uint256 &rt) const {
+    return cacheAnchors.find(rt) != cacheAnchors.end();
+}
+
+bool CCoinsViewCache::HaveNullifierInCache(const uint256 &nullifier) const {
+    return cacheNullifiers.find(nullifier) != cacheNullifiers.end();
+}
+
+void CCoinsViewCache::AddFetchedCoins(const uint256 &txid, CCoins &coins) {
+    std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    if (!ret.second)
+        return;
+    coins.swap(ret.first->second.coins);
+    if (ret.first->second.coins.IsPruned())
+        ret.first->second.flags = CCoinsCacheEntry::FRESH;
+    cachedCoinsUsage += ret.first->second.coins.DynamicMemoryUsage();
+}
+
+void CCoinsViewCache::AddFetchedAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree) {
+    std::pair<CAnchorsMap::iterator, bool> ret = cacheAnchors.insert(std::make_pair(rt, CAnchorsCacheEntry()));
+    if (!ret.second)
+        return;
+    ret.first->second.entered = true;
+    ret.first->second.tree = tree;
+    cachedCoinsUsage += ret.first->second.tree.DynamicMemoryUsage();
+}
+
+void CCoinsViewCache::AddFetchedNullifier(const uint256 &nullifier, bool spent) {
+    CNullifiersCacheEntry entry;
+    entry.entered = spent;
+    cacheNullifiers.insert(std::make_pair(nullifier, entry));
+}
+
 const CCoins* CCoinsViewCache::AccessCoins(const uint256 &txid) const {
     CCoinsMap::const_iterator it = FetchCoins(txid);
     if (it == cacheCoins.end()) {
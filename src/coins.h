@@ -322,7 +322,160 @@ struct CNullifiersCacheEntry
     CNullifiersCacheEntry() : entered(false), flags(0) {}
 };
 
-typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
+/**
+ * Hash map from txid to coins cache entry, with the subset of the
+ * boost::unordered_map interface the coins views use.
+ *
+ * The table is a flat array of slots probed linearly, each holding a tag
+ * taken from the salted key hash and a pointer to its entry, so most probes
+ * never touch an entry. Entries are allocated from arena chunks of growing
+ * size and never move, so as with a node based map, references to them stay
+ * valid until they are erased, also across rehashes. clear() releases the
+ * chunks wholesale instead of freeing one node at a time.
+ */
+class CCoinsMap
+{
+public:
+    typedef uint256 key_type;
+    typedef CCoinsCacheEntry mapped_type;
+    typedef std::pair<const uint256, CCoinsCacheEntry> value_type;
+
+private:
+    struct Slot
+    {
+        uint32_t nTag;
+        value_type* pvalue;
+
+        Slot() : nTag(TAG_EMPTY), pvalue(NULL) {}
+    };
+
+    //! Tags of free slots; the tags of used slots are always above these
+    enum { TAG_EMPTY = 0, TAG_DELETED = 1 };
+
+    static const size_t MIN_SLOTS = 16;
+    static const size_t MIN_CHUNK_ENTRIES = 16;
+    static const size_t MAX_CHUNK_ENTRIES = 4096;
+
+    uint256 salt;
+    std::vector<Slot> vSlots;
+    size_t nSize;
+    size_t nDeleted;
+
+    //! Arena chunks and their capacity in entries
+    std::vector<std::pair<char*, size_t> > vChunks;
+    //! Entries handed out from the last chunk
+    size_t nChunkUsed;
+    //! Singly linked list of the entries erased from the chunks
+    void* pfree;
+
+    uint64_t Hash(const uint256& key) const { return key.GetHash(salt); }
+    static uint32_t Tag(uint64_t hash) { return (uint32_t)(hash >> 32) | 2; }
+
+    //! Index of the slot holding key, or vSlots.size() if it is not in the map
+    size_t FindSlot(const uint256& key) const;
+    void Rehash(size_t nSlots);
+    value_type* AllocateEntry();
+    void FreeEntry(value_type* pvalue);
+
+    CCoinsMap(const CCoinsMap&);
+    CCoinsMap& operator=(const CCoinsMap&);
+
+public:
+    template<typename Value>
+    class Iterator
+    {
+    private:
+        friend class CCoinsMap;
+        template<typename> friend class Iterator;
+
+        const CCoinsMap* pmap;
+        size_t nSlot;
+        Value* pvalue;
+
+        Iterator(const CCoinsMap* pmapIn, size_t nSlotIn, Value* pvalueIn) : pmap(pmapIn), nSlot(nSlotIn), pvalue(pvalueIn) {}
+
+    public:
+        Iterator() : pmap(NULL), nSlot(0), pvalue(NULL) {}
+        //! Allows converting an iterator to a const_iterator, but not the reverse
+        template<typename Other>
+        Iterator(const Iterator<Other>& it) : pmap(it.pmap), nSlot(it.nSlot), pvalue(it.pvalue) {}
+
+        Value& operator*() const { return *pvalue; }
+        Value* operator->() const { return pvalue; }
+
+        Iterator& operator++() {
+            const std::vector<Slot>& vSlots = pmap->vSlots;
+            pvalue = NULL;
+            while (++nSlot < vSlots.size()) {
+                if (vSlots[nSlot].nTag > TAG_DELETED) {
+                    pvalue = vSlots[nSlot].pvalue;
+                    break;
+                }
+            }
+            return *this;
+        }
+        Iterator operator++(int) {
+            Iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+
+        template<typename Other>
+        bool operator==(const Iterator<Other>& it) const { return pvalue == it.pvalue; }
+        template<typename Other>
+        bool operator!=(const Iterator<Other>& it) const { return pvalue != it.pvalue; }
+    };
+
+    typedef Iterator<value_type> iterator;
+    typedef Iterator<const value_type> const_iterator;
+
+    CCoinsMap();
+    ~CCoinsMap();
+
+    iterator begin() { return ++iterator(this, (size_t)-1, NULL); }
+    const_iterator begin() const { return ++const_iterator(this, (size_t)-1, NULL); }
+    iterator end() { return iterator(this, vSlots.size(), NULL); }
+    const_iterator end() const { return const_iterator(this, vSlots.size(), NULL); }
+
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& key) {
+        size_t nSlot = FindSlot(key);
+        return nSlot < vSlots.size() ? iterator(this, nSlot, vSlots[nSlot].pvalue) : end();
+    }
+    const_iterator find(const uint256& key) const {
+        size_t nSlot = FindSlot(key);
+        return nSlot < vSlots.size() ? const_iterator(this, nSlot, vSlots[nSlot].pvalue) : end();
+    }
+
+    std::pair<iterator, bool> insert(const value_type& value);
+    CCoinsCacheEntry& operator[](const uint256& key) {
+        return insert(std::make_pair(key, CCoinsCacheEntry())).first->second;
+    }
+
+    void erase(iterator it);
+    //! Destroy all entries and release the table and the arena
+    void clear();
+
+    //! Heap memory used by the table and the arena, not counting what the entries own
+    size_t DynamicMemoryUsage() const {
+        size_t ret = memusage::MallocUsage(vSlots.capacity() * sizeof(Slot));
+        for (size_t i = 0; i < vChunks.size(); i++)
+            ret += memusage::MallocUsage(vChunks[i].second * sizeof(value_type));
+        return ret;
+    }
+};
+
+namespace memusage {
+
+static inline size_t DynamicUsage(const CCoinsMap& m)
+{
+    return m.DynamicMemoryUsage();
+}
+
+}
+
 typedef boost::unordered_map<uint256, CAnchorsCacheEntry, CCoinsKeyHasher> CAnchorsMap;
 typedef boost::unordered_map<uint256, CNullifiersCacheEntry, CCoinsKeyHasher> CNullifiersMap;
 
@@ -394,6 +547,7 @@ public:
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor() const;
     void SetBackend(CCoinsView &viewIn);
+    CCoinsView* GetBackend() const;
     bool BatchWrite(CCoinsMap &mapCoins,
                     const uint256 &hashBlock,
                     const uint256 &hashAnchor,
@@ -490,6 +644,19 @@ public:
      */
     CCoinsModifier ModifyCoins(const uint256 &txid);
 
+    //! Check whether an entry is in this cache, without fetching it from the base view
+    bool HaveCoinsInCache(const uint256 &txid) const;
+    bool HaveAnchorInCache(const uint256 &rt) const;
+    bool HaveNullifierInCache(const uint256 &nullifier) const;
+
+    /**
+     * Cache an entry read from the base view ahead of time, as the Get
+     * methods would have cached it. Entries already in this cache are kept.
+     */
+    void AddFetchedCoins(const uint256 &txid, CCoins &coins);
+    void AddFetchedAnchor(const uint256 &rt, const ZCIncrementalMerkleTree &tree);
+    void AddFetchedNullifier(const uint256 &nullifier, bool spent);
+
     /**
      * Push the modifications applied to this cache to its base.
      * Failure to call this method before destruction will cause the changes to be forgotten.
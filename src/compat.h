@@ -44,9 +44,17 @@
 #include <ifaddrs.h>
 #include <limits.h>
 #include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 
+// Linux waits on sockets with poll() and the socket handler with epoll, so
+// there is no FD_SETSIZE limit on the number of connections
+#if defined(__linux__)
+#define USE_POLL
+#define USE_EPOLL
+#endif
+
 #ifdef WIN32
 #define MSG_DONTWAIT        0
 #else
@@ -95,7 +103,7 @@ size_t strnlen( const char *start, size_t max_len);
 #endif // HAVE_DECL_STRNLEN
 
 bool static inline IsSelectableSocket(SOCKET s) {
-#ifdef WIN32
+#if defined(WIN32) || defined(USE_POLL)
     return true;
 #else
     return (s < FD_SETSIZE);
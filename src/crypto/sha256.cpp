@@ -10,6 +10,24 @@
 #include <string.h>
 #include <stdexcept>
 
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#if defined(ENABLE_SSE41) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sha256d64_sse41
+{
+void Transform_4way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#if defined(ENABLE_AVX2) && !defined(BUILD_BITCOIN_INTERNAL)
+namespace sha256d64_avx2
+{
+void Transform_8way(unsigned char* out, const unsigned char* in);
+}
+#endif
+
 // Internal implementation code.
 namespace
 {
@@ -129,9 +147,114 @@ void Transform(uint32_t* s, const unsigned char* chunk)
     s[7] += h;
 }
 
+/** Compute the double SHA-256 of one 64-byte input. */
+void TransformD64(unsigned char* out, const unsigned char* in)
+{
+    // The second block of the first hash is the padding of a 64-byte
+    // message, and the second hash is one block of 32 bytes and padding
+    static const unsigned char pad64[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0x00};
+    uint32_t s[8];
+    unsigned char buf[64] = {0};
+    Initialize(s);
+    Transform(s, in);
+    Transform(s, pad64);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(buf + 4 * i, s[i]);
+    buf[32] = 0x80;
+    buf[62] = 0x01;
+    Initialize(s);
+    Transform(s, buf);
+    for (int i = 0; i < 8; i++)
+        WriteBE32(out + 4 * i, s[i]);
+}
+
+typedef void (*TransformD64Wide)(unsigned char* out, const unsigned char* in);
+
+/** The multi-buffer implementations the CPU supports, picked once. */
+struct CTransformD64Impl
+{
+    TransformD64Wide transform4;
+    TransformD64Wide transform8;
+    std::string strName;
+
+    CTransformD64Impl() : transform4(NULL), transform8(NULL), strName("standard")
+    {
+#if (defined(__x86_64__) || defined(__amd64__) || defined(__i386__)) && !defined(BUILD_BITCOIN_INTERNAL)
+        uint32_t eax, ebx, ecx, edx;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            return;
+#if defined(ENABLE_SSE41)
+        if ((ecx >> 19) & 1) {
+            transform4 = sha256d64_sse41::Transform_4way;
+            strName += ",sse41(4way)";
+        }
+#endif
+#if defined(ENABLE_AVX2)
+        // AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0)
+        bool fAVX = ((ecx >> 27) & 1) && ((ecx >> 28) & 1);
+        if (fAVX) {
+            uint32_t xcr0_lo, xcr0_hi;
+            __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+            fAVX = (xcr0_lo & 6) == 6;
+        }
+        if (fAVX && __get_cpuid_max(0, NULL) >= 7) {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if ((ebx >> 5) & 1) {
+                transform8 = sha256d64_avx2::Transform_8way;
+                strName += ",avx2(8way)";
+            }
+        }
+#endif
+#endif
+    }
+};
+
+const CTransformD64Impl& GetTransformD64()
+{
+    // Function-local, as block merkle roots are computed during static
+    // initialization of the chain parameters
+    static const CTransformD64Impl impl;
+    return impl;
+}
+
 } // namespace sha256
 } // namespace
 
+std::string SHA256AutoDetect()
+{
+    return sha256::GetTransformD64().strName;
+}
+
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    const sha256::CTransformD64Impl& impl = sha256::GetTransformD64();
+    if (impl.transform8) {
+        while (blocks >= 8) {
+            impl.transform8(out, in);
+            out += 256;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (impl.transform4) {
+        while (blocks >= 4) {
+            impl.transform4(out, in);
+            out += 128;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        sha256::TransformD64(out, in);
+        out += 32;
+        in += 64;
+        blocks--;
+    }
+}
+
 
 ////// SHA-256
 
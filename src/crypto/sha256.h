@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string>
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -30,4 +31,17 @@ private:
     void FinalizeNoPadding(unsigned char hash[OUTPUT_SIZE], bool enforce_compression);
 };
 
+/** Describe the SHA-256 implementations SHA256D64 uses on this CPU. */
+std::string SHA256AutoDetect();
+
+/**
+ * Compute the double SHA-256 of each of several 64-byte inputs, several at
+ * once when the CPU supports it.
+ *
+ * out:    pointer to a blocks*32 byte output buffer
+ * in:     pointer to a blocks*64 byte input buffer
+ * blocks: the number of hashes to compute
+ */
+void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks);
+
 #endif // BITCOIN_CRYPTO_SHA256_H
@@ -35,9 +35,12 @@ class CLevelDBBatch
 private:
 
     leveldb::WriteBatch batch;
+    size_t size_estimate;
 
 public:
-  
+
+    CLevelDBBatch() : size_estimate(0) { }
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -52,6 +55,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        size_estimate += slKey.size() + slValue.size();
     }
 
     template <typename K>
@@ -63,7 +67,17 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        size_estimate += slKey.size();
+    }
+
+    void Clear()
+    {
+        batch.Clear();
+        size_estimate = 0;
     }
+
+    //! Approximate number of key and value bytes queued in this batch
+    size_t SizeEstimate() const { return size_estimate; }
 };
 
 
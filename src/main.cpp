@@ -33,6 +33,9 @@
 #include "wallet/asyncrpcoperation_sendmany.h"
 #include "wallet/asyncrpcoperation_shieldcoinbase.h"
 
+#include <deque>
+#include <list>
+#include <memory>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -40,8 +43,13 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 #include <boost/static_assert.hpp>
 
+#ifndef WIN32
+#include <sys/stat.h>
+#endif
+
 using namespace std;
 
 #if defined(NDEBUG)
@@ -565,6 +573,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CIndexDB *pindexdb = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -851,8 +860,82 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+namespace {
+
+/**
+ * Bounded set of JoinSplit proofs that verified. AcceptToMemoryPool fills it,
+ * so connecting a block made of transactions already in the mempool does not
+ * verify their proofs a second time. Entries are a salted hash of the
+ * JoinSplit description and the joinSplitPubKey signing it, and the oldest
+ * ones are evicted first once the cache is full.
+ */
+class CProofCache
+{
+private:
+    struct CKeyHasher
+    {
+        size_t operator()(const uint256& key) const { return key.GetCheapHash(); }
+    };
+
+    CCriticalSection cs;
+    uint256 salt;
+    //! Valid proofs, mapped to the insertion number of their entry in dequeInserted
+    boost::unordered_map<uint256, uint64_t, CKeyHasher> mapValid;
+    std::deque<std::pair<uint256, uint64_t> > dequeInserted;
+    uint64_t nInserted;
+
+    uint256 GetKey(const JSDescription& joinsplit, const uint256& joinSplitPubKey) const
+    {
+        CHashWriter ss(SER_GETHASH, 0);
+        ss << salt << joinsplit << joinSplitPubKey;
+        return ss.GetHash();
+    }
+
+public:
+    CProofCache() : nInserted(0) { GetRandBytes(salt.begin(), salt.size()); }
+
+    //! Whether the proof is in the cache, removing it if fErase is set
+    bool Get(const JSDescription& joinsplit, const uint256& joinSplitPubKey, bool fErase)
+    {
+        uint256 key = GetKey(joinsplit, joinSplitPubKey);
+        LOCK(cs);
+        boost::unordered_map<uint256, uint64_t, CKeyHasher>::iterator it = mapValid.find(key);
+        if (it == mapValid.end())
+            return false;
+        // The stale entry left in dequeInserted is skipped when it is evicted
+        if (fErase)
+            mapValid.erase(it);
+        return true;
+    }
+
+    void Set(const JSDescription& joinsplit, const uint256& joinSplitPubKey)
+    {
+        int64_t nMaxSize = GetArg("-maxproofcachesize", DEFAULT_MAX_PROOF_CACHE_SIZE);
+        if (nMaxSize <= 0)
+            return;
+
+        uint256 key = GetKey(joinsplit, joinSplitPubKey);
+        LOCK(cs);
+        if (!mapValid.insert(std::make_pair(key, nInserted)).second)
+            return;
+        dequeInserted.push_back(std::make_pair(key, nInserted++));
+        while (mapValid.size() > (size_t)nMaxSize || dequeInserted.size() > 2 * (size_t)nMaxSize) {
+            // Only evict the key if this is its latest insertion, not a stale
+            // copy left behind by an erase and a later re-insert.
+            boost::unordered_map<uint256, uint64_t, CKeyHasher>::iterator it = mapValid.find(dequeInserted.front().first);
+            if (it != mapValid.end() && it->second == dequeInserted.front().second)
+                mapValid.erase(it);
+            dequeInserted.pop_front();
+        }
+    }
+};
+
+CProofCache proofCache;
+
+}
+
 bool CheckTransaction(const CTransaction& tx, CValidationState &state,
-                      libzcash::ProofVerifier& verifier)
+                      libzcash::ProofVerifier& verifier, bool fProofCache)
 {
     // Don't count coinbase transactions because mining skews the count
     if (!tx.IsCoinBase()) {
@@ -864,10 +947,14 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
     } else {
         // Ensure that zk-SNARKs verify
         BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+            if (fProofCache && proofCache.Get(joinsplit, tx.joinSplitPubKey, false))
+                continue;
             if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
                 return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
             }
+            if (fProofCache)
+                proofCache.Set(joinsplit, tx.joinSplitPubKey);
         }
         return true;
     }
@@ -1068,7 +1155,8 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit,
+                        CCoinsView* pcoinsView)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1086,7 +1174,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     }
 
     auto verifier = libzcash::ProofVerifier::Strict();
-    if (!CheckTransaction(tx, state, verifier))
+    if (!CheckTransaction(tx, state, verifier, true))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1141,7 +1229,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nValueIn = 0;
         {
         LOCK(pool.cs);
-        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewMemPool viewMemPool(pcoinsView ? pcoinsView : pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
         // do we already have it?
@@ -1214,6 +1302,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Once the mempool has had to evict, a transaction must pay more
+        // than the packages it evicted, JoinSplits included
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                    hash.ToString(), nFees, mempoolRejectFee),
+                            REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1281,6 +1377,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         if (fSpentIndex) {
             pool.addSpentIndex(entry, view);
         }
+
+        // Trim the mempool and check that the transaction was not evicted
+        if (!fOverrideMempoolLimit) {
+            pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1288,12 +1391,47 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool PreCheckTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, CCoinsView* pcoinsView)
+{
+    // Verifies the JoinSplit proofs and remembers them for AcceptToMemoryPool
+    auto verifier = libzcash::ProofVerifier::Strict();
+    if (!CheckTransaction(tx, state, verifier, true))
+        return error("PreCheckTransaction: CheckTransaction failed");
+
+    if (tx.IsCoinBase())
+        return true;
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        LOCK2(cs_main, pool.cs);
+        CCoinsViewMemPool viewMemPool(pcoinsView ? pcoinsView : pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+
+        // Leave missing and spent inputs to AcceptToMemoryPool
+        if (!view.HaveInputs(tx))
+            return true;
+
+        // Bring the best block into scope
+        view.GetBestBlock();
+
+        // we have all inputs cached now, so switch back to dummy, so we don't need to keep the locks
+        view.SetBackend(dummy);
+    }
+
+    // Verifies the signatures and stores them in the signature cache
+    if (!ContextualCheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+        return error("PreCheckTransaction: ConnectInputs failed %s", tx.GetHash().ToString());
+
+    return true;
+}
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes)
 {
     if (!fTimestampIndex)
         return error("Timestamp index not enabled");
 
-    if (!pblocktree->ReadTimestampIndex(high, low, fActiveOnly, hashes))
+    if (!pindexdb->ReadTimestampIndex(high, low, fActiveOnly, hashes))
         return error("Unable to get hashes for timestamps");
 
     return true;
@@ -1307,19 +1445,20 @@ bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
     if (mempool.getSpentIndex(key, value))
         return true;
 
-    if (!pblocktree->ReadSpentIndex(key, value))
+    if (!pindexdb->ReadSpentIndex(key, value))
         return false;
 
     return true;
 }
 
 bool GetAddressIndex(uint160 addressHash, int type,
-                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end)
+                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex, int start, int end,
+                     const CAddressIndexKey *pkeyAfter, size_t nLimit)
 {
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
+    if (!pindexdb->ReadAddressIndex(addressHash, type, addressIndex, start, end, pkeyAfter, nLimit))
         return error("unable to get txids for address");
 
     return true;
@@ -1331,12 +1470,29 @@ bool GetAddressUnspent(uint160 addressHash, int type,
     if (!fAddressIndex)
         return error("address index not enabled");
 
-    if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+    if (!pindexdb->ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
         return error("unable to get txids for address");
 
     return true;
 }
 
+bool GetAddressBalance(uint160 addressHash, int type, CAmount &balance, CAmount &received)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    CAddressBalanceValue value;
+    if (pindexdb->ReadAddressBalance(addressHash, type, value)) {
+        balance = value.balance;
+        received = value.received;
+    } else {
+        balance = 0;
+        received = 0;
+    }
+
+    return true;
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1503,6 +1659,169 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 
     return true;
 }
+namespace {
+
+/** A blk?????.dat or rev?????.dat file mapped into memory for reading */
+class CMappedBlockFile
+{
+private:
+    // Disallow copies
+    CMappedBlockFile(const CMappedBlockFile&);
+    CMappedBlockFile& operator=(const CMappedBlockFile&);
+
+public:
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedBlockFile(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+
+    ~CMappedBlockFile()
+    {
+#ifndef WIN32
+        munmap((void*)pbegin, nSize);
+#endif
+    }
+};
+
+typedef std::shared_ptr<const CMappedBlockFile> MappedBlockFilePtr;
+
+/**
+ * The most recently read block and undo files, kept mapped into memory so
+ * that reading a block neither opens nor seeks a file. A file that has grown
+ * since it was mapped is mapped again when a read reaches past the old
+ * mapping. Readers hold on to the mapping they got, so a file can be mapped
+ * again, evicted or pruned while it is being read.
+ */
+class CMappedBlockFileCache
+{
+private:
+    //! File number and whether it is the undo file
+    typedef std::pair<int, bool> Key;
+    typedef std::list<std::pair<Key, MappedBlockFilePtr> > List;
+
+    CCriticalSection cs;
+    //! Mapped files, most recently used first
+    List lru;
+    std::map<Key, List::iterator> mapFiles;
+    //! Number of times files were dropped by Erase
+    uint64_t nErased;
+
+    static MappedBlockFilePtr MapFile(const Key& key)
+    {
+#ifdef WIN32
+        return MappedBlockFilePtr();
+#else
+        // Mapping whole files would quickly exhaust a 32-bit address space
+        if (sizeof(void*) < 8)
+            return MappedBlockFilePtr();
+
+        boost::filesystem::path path = GetBlockPosFilename(CDiskBlockPos(key.first, 0), key.second ? "rev" : "blk");
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return MappedBlockFilePtr();
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return MappedBlockFilePtr();
+        return std::make_shared<const CMappedBlockFile>((const char*)p, (size_t)st.st_size);
+#endif
+    }
+
+public:
+    CMappedBlockFileCache() : nErased(0) {}
+
+    /**
+     * Get a mapping of a block or undo file that covers at least its first
+     * nEnd bytes. Returns NULL if the file is shorter or can't be mapped.
+     */
+    MappedBlockFilePtr Get(int nFile, bool fUndo, size_t nEnd)
+    {
+        Key key(nFile, fUndo);
+        uint64_t nErasedBefore;
+        {
+            LOCK(cs);
+            std::map<Key, List::iterator>::iterator it = mapFiles.find(key);
+            if (it != mapFiles.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                if (it->second->second->nSize >= nEnd)
+                    return it->second->second;
+            }
+            nErasedBefore = nErased;
+        }
+
+        // Map the file, or map it again if it grew, without holding cs
+        MappedBlockFilePtr mapped = MapFile(key);
+        if (!mapped)
+            return mapped;
+
+        {
+            LOCK(cs);
+            // Don't keep a mapping of a file that was pruned or truncated meanwhile
+            if (nErased == nErasedBefore) {
+                std::map<Key, List::iterator>::iterator it = mapFiles.find(key);
+                if (it != mapFiles.end()) {
+                    if (it->second->second->nSize < mapped->nSize)
+                        it->second->second = mapped;
+                } else {
+                    lru.push_front(std::make_pair(key, mapped));
+                    mapFiles[key] = lru.begin();
+                    while (lru.size() > MAX_MAPPED_BLOCK_FILES) {
+                        mapFiles.erase(lru.back().first);
+                        lru.pop_back();
+                    }
+                }
+            }
+        }
+        if (mapped->nSize < nEnd)
+            return MappedBlockFilePtr();
+        return mapped;
+    }
+
+    /** Drop the mappings of a block file and its undo file */
+    void Erase(int nFile)
+    {
+        LOCK(cs);
+        for (int fUndo = 0; fUndo < 2; fUndo++) {
+            std::map<Key, List::iterator>::iterator it = mapFiles.find(Key(nFile, fUndo));
+            if (it != mapFiles.end()) {
+                lru.erase(it->second);
+                mapFiles.erase(it);
+            }
+        }
+        nErased++;
+    }
+};
+
+CMappedBlockFileCache mappedBlockFiles;
+
+/**
+ * Map the record stored at pos in a block or undo file, whose size is
+ * written in the four bytes before it, along with the nTrailer bytes that
+ * follow it. Returns NULL if it isn't in a mappable file, in which case
+ * pbegin and pend are left alone.
+ */
+MappedBlockFilePtr MapDiskRecord(const CDiskBlockPos& pos, bool fUndo, size_t nTrailer, const char*& pbegin, const char*& pend)
+{
+    if (pos.IsNull() || pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return MappedBlockFilePtr();
+    MappedBlockFilePtr mapped = mappedBlockFiles.Get(pos.nFile, fUndo, pos.nPos);
+    if (!mapped)
+        return mapped;
+    size_t nEnd = pos.nPos + (size_t)ReadLE32((const unsigned char*)mapped->pbegin + pos.nPos - sizeof(unsigned int)) + nTrailer;
+    if (nEnd > mapped->nSize)
+        mapped = mappedBlockFiles.Get(pos.nFile, fUndo, nEnd);
+    if (mapped) {
+        pbegin = mapped->pbegin + pos.nPos;
+        pend = mapped->pbegin + nEnd;
+    }
+    return mapped;
+}
+
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1518,16 +1837,30 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     if (fTxIndex) {
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
             CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            const char* pbegin;
+            const char* pend;
+            MappedBlockFilePtr mapped = MapDiskRecord(postx, false, 0, pbegin, pend);
+            if (mapped) {
+                try {
+                    CMemoryReader file(pbegin, pend, SER_DISK, CLIENT_VERSION);
+                    file >> header;
+                    file.ignore(postx.nTxOffset);
+                    file >> txOut;
+                } catch (const std::exception& e) {
+                    return error("%s: Deserialize error - %s", __func__, e.what());
+                }
+            } else {
+                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+                if (file.IsNull())
+                    return error("%s: OpenBlockFile failed", __func__);
+                try {
+                    file >> header;
+                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+                    file >> txOut;
+                } catch (const std::exception& e) {
+                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+                }
             }
             hashBlock = header.GetHash();
             if (txOut.GetHash() != hash)
@@ -1595,10 +1928,25 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+static bool ReadBlockDataFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
+    // Deserialize straight from the mapped file where possible
+    const char* pbegin;
+    const char* pend;
+    MappedBlockFilePtr mapped = MapDiskRecord(pos, false, 0, pbegin, pend);
+    if (mapped) {
+        try {
+            CMemoryReader filein(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -1612,6 +1960,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
+{
+    if (!ReadBlockDataFromDisk(block, pos))
+        return false;
+
     // Check the header
     if (!(CheckEquihashSolution(&block, Params()) &&
           CheckProofOfWork(block.GetHash(), block.nBits, Params().GetConsensus())))
@@ -1620,8 +1976,23 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock)
+{
+    if (!ReadBlockDataFromDisk(block, pos))
+        return false;
+
+    // The header was checked before the block was stored; the hash commits
+    // to it, so there is no need to verify the Equihash solution again.
+    if (block.GetHash() != hashBlock)
+        return error("ReadBlockFromDisk: GetHash() doesn't match %s at %s", hashBlock.ToString(), pos.ToString());
+
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
+    if (pindex->IsValid(BLOCK_VALID_TREE))
+        return ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash());
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
         return false;
     if (block.GetHash() != pindex->GetBlockHash())
@@ -1630,6 +2001,154 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(CDataStream& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    block.clear();
+
+    // Copy the block out of its mapped file where possible
+    const char* pbegin;
+    const char* pend;
+    MappedBlockFilePtr mapped = MapDiskRecord(pos, false, 0, pbegin, pend);
+    if (mapped) {
+        if (memcmp(pbegin - MESSAGE_START_SIZE - sizeof(unsigned int), messageStart, MESSAGE_START_SIZE))
+            return error("ReadRawBlockFromDisk: Block magic mismatch for %s", pos.ToString());
+        if ((size_t)(pend - pbegin) > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk: Block data is larger than maximum block size for %s", pos.ToString());
+        block.write(pbegin, pend - pbegin);
+        return true;
+    }
+
+    // Open history file at the index header written before the block
+    CDiskBlockPos hpos = pos;
+    if (hpos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("ReadRawBlockFromDisk: Invalid block position %s", pos.ToString());
+    hpos.nPos -= MESSAGE_START_SIZE + sizeof(unsigned int);
+    CAutoFile filein(OpenBlockFile(hpos, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("ReadRawBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE))
+            return error("ReadRawBlockFromDisk: Block magic mismatch for %s", pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("ReadRawBlockFromDisk: Block data is larger than maximum block size for %s", pos.ToString());
+
+        block.resize(nSize);
+        filein.read(&block[0], nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: Read from block file failed - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
+void PrefetchBlocksFromDisk(const std::vector<const CBlockIndex*>& vBlocks)
+{
+    // Cover all requested blocks of a file with one read-ahead, since the
+    // blocks of a height range are mostly stored next to each other
+    std::map<int, std::pair<unsigned int, unsigned int> > mapRanges;
+    BOOST_FOREACH(const CBlockIndex* pindex, vBlocks) {
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA))
+            continue;
+        std::map<int, std::pair<unsigned int, unsigned int> >::iterator it = mapRanges.find(pindex->nFile);
+        if (it == mapRanges.end()) {
+            mapRanges[pindex->nFile] = std::make_pair(pindex->nDataPos, pindex->nDataPos);
+        } else {
+            it->second.first = std::min(it->second.first, pindex->nDataPos);
+            it->second.second = std::max(it->second.second, pindex->nDataPos);
+        }
+    }
+
+    for (std::map<int, std::pair<unsigned int, unsigned int> >::const_iterator it = mapRanges.begin(); it != mapRanges.end(); it++) {
+        FILE* file = OpenBlockFile(CDiskBlockPos(it->first, 0), true);
+        if (!file)
+            continue;
+        // The size of the last block is unknown, so read up to the largest possible one
+        FileReadAhead(file, it->second.first, it->second.second - it->second.first + MAX_BLOCK_SIZE);
+        fclose(file);
+    }
+}
+
+namespace {
+
+/** A block recently connected to the active chain, with its serialization once it was asked for */
+struct CRecentBlock
+{
+    uint256 hash;
+    std::shared_ptr<const CBlock> block;
+    std::shared_ptr<const CDataStream> bytes;
+};
+
+CCriticalSection cs_recentBlocks;
+//! The last MAX_RECENT_BLOCKS blocks connected, oldest first
+std::deque<CRecentBlock> vRecentBlocks;
+
+void AddRecentBlock(const std::shared_ptr<const CBlock>& pblock)
+{
+    CRecentBlock recent;
+    recent.hash = pblock->GetHash();
+    recent.block = pblock;
+
+    LOCK(cs_recentBlocks);
+    BOOST_FOREACH(const CRecentBlock& other, vRecentBlocks) {
+        if (other.hash == recent.hash)
+            return;
+    }
+    vRecentBlocks.push_back(recent);
+    if (vRecentBlocks.size() > MAX_RECENT_BLOCKS)
+        vRecentBlocks.pop_front();
+}
+
+}
+
+std::shared_ptr<const CBlock> GetRecentBlock(const uint256& hash)
+{
+    LOCK(cs_recentBlocks);
+    BOOST_FOREACH(const CRecentBlock& recent, vRecentBlocks) {
+        if (recent.hash == hash)
+            return recent.block;
+    }
+    return std::shared_ptr<const CBlock>();
+}
+
+std::shared_ptr<const CDataStream> GetRecentBlockBytes(const uint256& hash)
+{
+    std::shared_ptr<const CBlock> pblock;
+    {
+        LOCK(cs_recentBlocks);
+        BOOST_FOREACH(const CRecentBlock& recent, vRecentBlocks) {
+            if (recent.hash == hash) {
+                if (recent.bytes)
+                    return recent.bytes;
+                pblock = recent.block;
+                break;
+            }
+        }
+    }
+    if (!pblock)
+        return std::shared_ptr<const CDataStream>();
+
+    // Serialize the block on first use, without holding cs_recentBlocks
+    std::shared_ptr<CDataStream> pbytes = std::make_shared<CDataStream>(SER_NETWORK, PROTOCOL_VERSION);
+    pbytes->reserve(::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
+    *pbytes << *pblock;
+
+    LOCK(cs_recentBlocks);
+    BOOST_FOREACH(CRecentBlock& recent, vRecentBlocks) {
+        if (recent.hash == hash) {
+            if (!recent.bytes)
+                recent.bytes = pbytes;
+            return recent.bytes;
+        }
+    }
+    return pbytes;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 50 * COIN;
@@ -1846,6 +2365,18 @@ bool CScriptCheck::operator()() {
     return true;
 }
 
+bool CProofCheck::operator()() {
+    // A connected proof is not needed again, unless the block is disconnected
+    // and its transactions return to the mempool, which verifies them anew.
+    // Blocks only checked (templates, proposals) leave the cache alone.
+    if (proofCache.Get(*pjoinsplit, joinSplitPubKey, fCacheErase))
+        return true;
+    auto verifier = libzcash::ProofVerifier::Strict();
+    if (!pjoinsplit->Verify(*pzcashParams, verifier, joinSplitPubKey))
+        return ::error("CProofCheck(): joinsplit does not verify");
+    return true;
+}
+
 int GetSpendHeight(const CCoinsViewCache& inputs)
 {
     LOCK(cs_main);
@@ -2012,19 +2543,35 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenBlockFile failed", __func__);
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> blockundo;
-        filein >> hashChecksum;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+
+    // Deserialize straight from the mapped file where possible
+    const char* pbegin;
+    const char* pend;
+    MappedBlockFilePtr mapped = MapDiskRecord(pos, true, sizeof(hashChecksum), pbegin, pend);
+    if (mapped) {
+        try {
+            CMemoryReader filein(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+
+        // Read block
+        try {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -2090,63 +2637,242 @@ static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const CO
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+bool GetScriptAddressIndex(const CScript& script, int& addressType, uint160& hashBytes)
 {
-    assert(pindex->GetBlockHash() == view.GetBestBlock());
+    if (script.IsPayToScriptHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin()+2, script.begin()+22));
+        addressType = ADDRESSINDEX_SCRIPTHASH;
+    } else if (script.IsPayToPublicKeyHash()) {
+        hashBytes = uint160(vector<unsigned char>(script.begin()+3, script.begin()+23));
+        addressType = ADDRESSINDEX_PUBKEYHASH;
+    } else if (!script.empty() && !script.IsUnspendable()) {
+        hashBytes = Hash160(script.begin(), script.end());
+        addressType = ADDRESSINDEX_SCRIPT;
+    } else {
+        hashBytes.SetNull();
+        addressType = 0;
+        return false;
+    }
+    return true;
+}
 
-    if (pfClean)
-        *pfClean = false;
+static unsigned int GetEnabledIndexes()
+{
+    unsigned int nIndexes = 0;
+    if (fAddressIndex)
+        nIndexes |= INDEX_BUILD_ADDRESS;
+    if (fSpentIndex)
+        nIndexes |= INDEX_BUILD_SPENT;
+    if (fTimestampIndex)
+        nIndexes |= INDEX_BUILD_TIMESTAMP;
+    return nIndexes;
+}
 
-    bool fClean = true;
+static void GetTxOutIndexUpdates(const CTransaction& tx, unsigned int i, int nHeight, bool fUndo,
+                                 std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& addressUnspentIndex)
+{
+    const uint256 txhash = tx.GetHash();
+    for (unsigned int k = 0; k < tx.vout.size(); k++) {
+        const CTxOut &out = tx.vout[k];
+        int addressType;
+        uint160 hashBytes;
+        if (!GetScriptAddressIndex(out.scriptPubKey, addressType, hashBytes))
+            continue;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+        // record receiving activity
+        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, k, false), out.nValue));
 
-    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
-        return error("DisconnectBlock(): block and undo data inconsistent");
+        // record the unspent output, or remove it when undoing
+        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k),
+                                                fUndo ? CAddressUnspentValue() : CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+    }
+}
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
-    // undo transactions in reverse order
-    for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction &tx = block.vtx[i];
-        uint256 hash = tx.GetHash();
+static void GetTxInIndexUpdates(const CTransaction& tx, const CTxUndo& txundo, unsigned int i, int nHeight, bool fUndo, bool fAddress, bool fSpent,
+                                std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex,
+                                std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& addressUnspentIndex,
+                                std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& spentIndex)
+{
+    const uint256 txhash = tx.GetHash();
+    for (unsigned int j = 0; j < tx.vin.size(); j++) {
+        const CTxIn &input = tx.vin[j];
+        const CTxInUndo &undo = txundo.vprevout[j];
+        const CTxOut &prevout = undo.txout;
+        int addressType;
+        uint160 hashBytes;
+        bool fIndexed = GetScriptAddressIndex(prevout.scriptPubKey, addressType, hashBytes);
 
-        if (fAddressIndex) {
+        if (fAddress && fIndexed) {
+            // record spending activity
+            addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, i, txhash, j, true), prevout.nValue * -1));
 
-            for (unsigned int k = tx.vout.size(); k-- > 0;) {
-                const CTxOut &out = tx.vout[k];
+            // remove the spent output from the unspent index, or restore it when undoing
+            addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n),
+                                                    fUndo ? CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight) : CAddressUnspentValue()));
+        }
 
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
+        if (fSpent) {
+            // add the spent index to determine the txid and input that spent an output
+            // and to find the amount and address from an input
+            spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n),
+                                           fUndo ? CSpentIndexValue() : CSpentIndexValue(txhash, j, nHeight, prevout.nValue, addressType, hashBytes)));
+        }
+    }
+}
 
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
+static bool BlockUndoMatches(const CBlock& block, const CBlockUndo& blockundo)
+{
+    if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+        return false;
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        if (blockundo.vtxundo[i-1].vprevout.size() != block.vtx[i].vin.size())
+            return false;
+    return true;
+}
+
+static void GetJoinSplitIndexUpdates(const CTransaction& tx, unsigned int i, int nHeight,
+                                     std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex)
+{
+    const uint256 txhash = tx.GetHash();
+    for (unsigned int js = 0; js < tx.vjoinsplit.size(); js++) {
+        const JSDescription &joinsplit = tx.vjoinsplit[js];
+
+        // transparent value entering the shielded pool
+        if (joinsplit.vpub_old > 0)
+            addressIndex.push_back(make_pair(CAddressIndexKey(ADDRESSINDEX_SPROUT, uint160(), nHeight, i, txhash, js, false), joinsplit.vpub_old));
+
+        // transparent value leaving the shielded pool
+        if (joinsplit.vpub_new > 0)
+            addressIndex.push_back(make_pair(CAddressIndexKey(ADDRESSINDEX_SPROUT, uint160(), nHeight, i, txhash, js, true), joinsplit.vpub_new * -1));
+    }
+}
+
+/**
+ * Collect the address and spent index updates for connecting a block, or for
+ * disconnecting it if fUndo is set. The spent outputs are taken from the
+ * block's undo data, so this does not depend on the coins view.
+ */
+static void GetBlockIndexUpdates(const CBlock& block, const CBlockUndo& blockundo, int nHeight, bool fUndo, bool fAddress, bool fSpent,
+                                 std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex,
+                                 std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& addressUnspentIndex,
+                                 std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >& spentIndex)
+{
+    // The unspent index updates are applied in order, so an output that is
+    // created and spent within the block must be added before it is removed,
+    // and restored before it is removed again when undoing.
+    if (!fUndo) {
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            if (i > 0)
+                GetTxInIndexUpdates(block.vtx[i], blockundo.vtxundo[i-1], i, nHeight, false, fAddress, fSpent, addressIndex, addressUnspentIndex, spentIndex);
+            if (fAddress) {
+                GetJoinSplitIndexUpdates(block.vtx[i], i, nHeight, addressIndex);
+                GetTxOutIndexUpdates(block.vtx[i], i, nHeight, false, addressIndex, addressUnspentIndex);
+            }
+        }
+    } else {
+        for (int i = block.vtx.size() - 1; i >= 0; i--) {
+            if (fAddress) {
+                GetTxOutIndexUpdates(block.vtx[i], i, nHeight, true, addressIndex, addressUnspentIndex);
+                GetJoinSplitIndexUpdates(block.vtx[i], i, nHeight, addressIndex);
+            }
+            if (i > 0)
+                GetTxInIndexUpdates(block.vtx[i], blockundo.vtxundo[i-1], i, nHeight, true, fAddress, fSpent, addressIndex, addressUnspentIndex, spentIndex);
+        }
+    }
+}
 
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), hash, k), CAddressUnspentValue()));
+static bool UpdateTimestampIndex(CIndexDB& db, const CBlockIndex* pindex, CValidationState& state)
+{
+    unsigned int logicalTS = pindex->nTime;
+    unsigned int prevLogicalTS = 0;
 
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
+    // retrieve logical timestamp of the previous block
+    if (pindex->pprev)
+        if (!db.ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
+            LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
 
-                    // undo receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, k, false), out.nValue));
+    if (logicalTS <= prevLogicalTS) {
+        logicalTS = prevLogicalTS + 1;
+        LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
+    }
 
-                    // undo unspent index
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), hash, k), CAddressUnspentValue()));
+    if (!db.WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
+        return AbortNode(state, "Failed to write timestamp index");
 
-                } else {
-                    continue;
-                }
+    if (!db.WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
+        return AbortNode(state, "Failed to write blockhash index");
 
-            }
+    return true;
+}
 
+/**
+ * Write the address, spent and timestamp index updates for connecting a
+ * block, or for disconnecting it if fUndo is set. Shared by ConnectBlock,
+ * DisconnectBlock and ThreadBuildIndexes.
+ */
+static bool UpdateBlockIndexes(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex,
+                               unsigned int nIndexes, bool fUndo, CValidationState& state)
+{
+    const bool fAddress = nIndexes & INDEX_BUILD_ADDRESS;
+    const bool fSpent = nIndexes & INDEX_BUILD_SPENT;
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+
+    if (fAddress || fSpent)
+        GetBlockIndexUpdates(block, blockundo, pindex->nHeight, fUndo, fAddress, fSpent, addressIndex, addressUnspentIndex, spentIndex);
+
+    if (fAddress) {
+        if (fUndo) {
+            if (!pindexdb->EraseAddressIndex(addressIndex))
+                return AbortNode(state, "Failed to delete address index");
+        } else {
+            if (!pindexdb->WriteAddressIndex(addressIndex))
+                return AbortNode(state, "Failed to write address index");
         }
+
+        if (!pindexdb->UpdateAddressUnspentIndex(addressUnspentIndex))
+            return AbortNode(state, "Failed to write address unspent index");
+    }
+
+    if (fSpent)
+        if (!pindexdb->UpdateSpentIndex(spentIndex))
+            return AbortNode(state, "Failed to write spent index");
+
+    // The timestamp index is kept when a block is disconnected.
+    if ((nIndexes & INDEX_BUILD_TIMESTAMP) && !fUndo)
+        if (!UpdateTimestampIndex(*pindexdb, pindex, state))
+            return false;
+
+    return true;
+}
+
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+{
+    assert(pindex->GetBlockHash() == view.GetBestBlock());
+
+    if (pfClean)
+        *pfClean = false;
+
+    bool fClean = true;
+
+    CBlockUndo blockUndo;
+    CDiskBlockPos pos = pindex->GetUndoPos();
+    if (pos.IsNull())
+        return error("DisconnectBlock(): no undo data available");
+    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
+        return error("DisconnectBlock(): failure reading undo data");
+
+    if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
+        return error("DisconnectBlock(): block and undo data inconsistent");
+
+    // undo transactions in reverse order
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction &tx = block.vtx[i];
+        uint256 hash = tx.GetHash();
+
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
         {
@@ -2183,97 +2909,592 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
                 const CTxInUndo &undo = txundo.vprevout[j];
                 if (!ApplyTxInUndo(undo, view, out))
                     fClean = false;
+            }
+        }
+    }
 
-                const CTxIn input = tx.vin[j];
+    // set the old best anchor back
+    view.PopAnchor(blockUndo.old_tree_root);
 
-                if (fSpentIndex) {
-                    // undo and delete the spent index
-                    spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue()));
-                }
+    // move best block pointer to prevout block
+    view.SetBestBlock(pindex->pprev->GetBlockHash());
+
+    if (pfClean) {
+        *pfClean = fClean;
+        return true;
+    }
+
+    if (!UpdateBlockIndexes(block, blockUndo, pindex, GetEnabledIndexes(), true, state))
+        return false;
+
+    if (fTxIndex)
+        if (!pblocktree->WriteBestIndexedBlock(pindex->pprev->GetBlockHash()))
+            return AbortNode(state, "Failed to write best indexed block");
+    if (fAddressIndex || fSpentIndex || fTimestampIndex)
+        if (!pindexdb->WriteBestIndexedBlock(pindex->pprev->GetBlockHash()))
+            return AbortNode(state, "Failed to write best indexed block");
+
+    return fClean;
+}
+
+void static FlushBlockFile(bool fFinalize = false)
+{
+    LOCK(cs_LastBlockFile);
 
-                if (fAddressIndex) {
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
+    CDiskBlockPos posOld(nLastBlockFile, 0);
+
+    FILE *fileOld = OpenBlockFile(posOld);
+    if (fileOld) {
+        if (fFinalize)
+            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+        FileCommit(fileOld);
+        fclose(fileOld);
+    }
+
+    fileOld = OpenUndoFile(posOld);
+    if (fileOld) {
+        if (fFinalize)
+            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
+        FileCommit(fileOld);
+        fclose(fileOld);
+    }
 
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
+    // Mappings of the files may reach past their truncated ends
+    if (fFinalize)
+        mappedBlockFiles.Erase(nLastBlockFile);
+}
 
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
+void ThreadScriptCheck() {
+    RenameThread("litecoinz-scriptch");
+    scriptcheckqueue.Thread();
+}
 
-                        // undo spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, hash, j, true), prevout.nValue * -1));
+// Proof checks take milliseconds each, so workers take one at a time
+static CCheckQueue<CProofCheck> proofcheckqueue(1);
 
-                        // restore unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undo.nHeight)));
+void ThreadProofCheck() {
+    RenameThread("litecoinz-proofch");
+    proofcheckqueue.Thread();
+}
 
-                    } else {
-                        continue;
-                    }
-                }
+/** A coins, anchor or nullifier entry of a block read ahead of ConnectBlock */
+struct CPrefetchedInput
+{
+    enum Type { COINS, ANCHOR, NULLIFIER };
+
+    Type type;
+    uint256 key;
+    //! Whether the entry was found; for a nullifier, whether it is spent
+    bool fFound;
+    CCoins coins;
+    ZCIncrementalMerkleTree tree;
+
+    CPrefetchedInput(Type typeIn, const uint256& keyIn) : type(typeIn), key(keyIn), fFound(false) {}
+};
+
+/** Closure reading one prefetched entry from the view below pcoinsTip */
+class CPrefetchCheck
+{
+private:
+    const CCoinsView *pview;
+    CPrefetchedInput *pinput;
+
+public:
+    CPrefetchCheck(): pview(0), pinput(0) {}
+    CPrefetchCheck(const CCoinsView& viewIn, CPrefetchedInput& inputIn) : pview(&viewIn), pinput(&inputIn) {}
+
+    bool operator()() {
+        switch (pinput->type) {
+        case CPrefetchedInput::COINS:
+            pinput->fFound = pview->GetCoins(pinput->key, pinput->coins);
+            break;
+        case CPrefetchedInput::ANCHOR:
+            pinput->fFound = pview->GetAnchorAt(pinput->key, pinput->tree);
+            break;
+        case CPrefetchedInput::NULLIFIER:
+            pinput->fFound = pview->GetNullifier(pinput->key);
+            break;
+        }
+        return true;
+    }
+
+    void swap(CPrefetchCheck &check) {
+        std::swap(pview, check.pview);
+        std::swap(pinput, check.pinput);
+    }
+};
+
+// Coins database reads take tens of microseconds, so workers take a few at a time
+static CCheckQueue<CPrefetchCheck> prefetchqueue(4);
+
+void ThreadPrefetchInputs() {
+    RenameThread("litecoinz-prefetch");
+    prefetchqueue.Thread();
+}
+
+/**
+ * Read the coins, anchors and nullifiers a block uses that pcoinsTip does not
+ * cache yet from the database on the prefetch threads, and cache them in
+ * pcoinsTip, so connecting the block rarely waits on a random read.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    AssertLockHeld(cs_main);
+    if (!nScriptCheckThreads)
+        return;
+
+    std::vector<CPrefetchedInput> vInputs;
+    std::set<std::pair<int, uint256> > setQueued;
+    std::set<uint256> setBlockTxids;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                // Outputs created earlier in the block are not in the database
+                const uint256& txid = txin.prevout.hash;
+                if (!setBlockTxids.count(txid) && !pcoinsTip->HaveCoinsInCache(txid) &&
+                    setQueued.insert(std::make_pair(CPrefetchedInput::COINS, txid)).second)
+                    vInputs.push_back(CPrefetchedInput(CPrefetchedInput::COINS, txid));
             }
         }
+        BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+            if (!pcoinsTip->HaveAnchorInCache(joinsplit.anchor) &&
+                setQueued.insert(std::make_pair(CPrefetchedInput::ANCHOR, joinsplit.anchor)).second)
+                vInputs.push_back(CPrefetchedInput(CPrefetchedInput::ANCHOR, joinsplit.anchor));
+            BOOST_FOREACH(const uint256& nullifier, joinsplit.nullifiers) {
+                if (!pcoinsTip->HaveNullifierInCache(nullifier) &&
+                    setQueued.insert(std::make_pair(CPrefetchedInput::NULLIFIER, nullifier)).second)
+                    vInputs.push_back(CPrefetchedInput(CPrefetchedInput::NULLIFIER, nullifier));
+            }
+        }
+        setBlockTxids.insert(tx.GetHash());
     }
+    if (vInputs.empty())
+        return;
 
-    // set the old best anchor back
-    view.PopAnchor(blockUndo.old_tree_root);
+    std::vector<CPrefetchCheck> vChecks;
+    vChecks.reserve(vInputs.size());
+    BOOST_FOREACH(CPrefetchedInput& input, vInputs)
+        vChecks.push_back(CPrefetchCheck(*pcoinsTip->GetBackend(), input));
+    CCheckQueueControl<CPrefetchCheck> control(&prefetchqueue);
+    control.Add(vChecks);
+    control.Wait();
+
+    BOOST_FOREACH(CPrefetchedInput& input, vInputs) {
+        switch (input.type) {
+        case CPrefetchedInput::COINS:
+            if (input.fFound)
+                pcoinsTip->AddFetchedCoins(input.key, input.coins);
+            break;
+        case CPrefetchedInput::ANCHOR:
+            if (input.fFound)
+                pcoinsTip->AddFetchedAnchor(input.key, input.tree);
+            break;
+        case CPrefetchedInput::NULLIFIER:
+            pcoinsTip->AddFetchedNullifier(input.key, input.fFound);
+            break;
+        }
+    }
+}
 
-    // move best block pointer to prevout block
-    view.SetBestBlock(pindex->pprev->GetBlockHash());
+/** Indexes being built by ThreadBuildIndexes and the last block applied to them, guarded by cs_main */
+static unsigned int nIndexBuildPending = 0;
+static const CBlockIndex* pindexIndexBuild = NULL;
 
-    if (pfClean) {
-        *pfClean = fClean;
+/**
+ * Shared state of BuildIndexesParallel(). Workers claim whole block files,
+ * write the address and spent index entries of their blocks directly, and
+ * hand the unspent index updates back to the calling thread, which applies
+ * them in height order since a spend must not be applied before the output
+ * it removes was added.
+ */
+class CParallelIndexBuild
+{
+private:
+    struct Block {
+        const CBlockIndex* pindex;
+        CDiskBlockPos blockPos;
+        CDiskBlockPos undoPos;
+    };
+
+    CIndexDB& db;
+    const bool fAddress;
+    const bool fSpent;
+
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    //! Blocks of each file ordered by position, files ordered by their lowest height
+    std::vector<std::pair<int, std::vector<Block> > > vFiles;
+    size_t nNextFile;
+    //! Unspent index updates of the blocks read so far but not yet applied, by height
+    std::map<int, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > > mapUnspent;
+    int nNextHeight;
+    bool fFailed;
+
+    //! Number of blocks whose unspent updates may wait to be applied before workers stop claiming files
+    static const size_t MAX_PENDING_BLOCKS = 10000;
+    //! Number of index entries a worker collects before writing them
+    static const size_t WORKER_BATCH_ENTRIES = 100000;
+
+    bool ProcessFile(const std::vector<Block>& vBlocks)
+    {
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+        BOOST_FOREACH(const Block& b, vBlocks) {
+            boost::this_thread::interruption_point();
+
+            CBlock block;
+            CBlockUndo blockundo;
+            if (!ReadBlockFromDisk(block, b.blockPos, b.pindex->GetBlockHash()) ||
+                !UndoReadFromDisk(blockundo, b.undoPos, b.pindex->pprev->GetBlockHash()) ||
+                !BlockUndoMatches(block, blockundo))
+                return error("%s: failed to read block or undo data for %s", __func__, b.pindex->GetBlockHash().ToString());
+
+            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+            GetBlockIndexUpdates(block, blockundo, b.pindex->nHeight, false, fAddress, fSpent, addressIndex, addressUnspentIndex, spentIndex);
+
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapUnspent[b.pindex->nHeight].swap(addressUnspentIndex);
+                if (b.pindex->nHeight == nNextHeight)
+                    cond.notify_all();
+            }
+
+            if (addressIndex.size() + spentIndex.size() >= WORKER_BATCH_ENTRIES) {
+                if (!db.WriteIndexEntries(addressIndex, spentIndex))
+                    return error("%s: failed to write index entries", __func__);
+                addressIndex.clear();
+                spentIndex.clear();
+            }
+        }
+        if (!db.WriteIndexEntries(addressIndex, spentIndex))
+            return error("%s: failed to write index entries", __func__);
         return true;
     }
 
-    if (fAddressIndex) {
-        if (!pblocktree->EraseAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to delete address index");
+    void Worker()
+    {
+        while (true) {
+            size_t nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                // Do not run too far ahead of the unspent index updates,
+                // unless the next file holds the height they wait for.
+                while (!fFailed && nNextFile < vFiles.size() && mapUnspent.size() >= MAX_PENDING_BLOCKS &&
+                       vFiles[nNextFile].first > nNextHeight)
+                    cond.wait(lock);
+                if (fFailed || nNextFile == vFiles.size())
+                    return;
+                nFile = nNextFile++;
+            }
+            if (!ProcessFile(vFiles[nFile].second)) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fFailed = true;
+                cond.notify_all();
+                return;
+            }
         }
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
+    }
+
+    static bool CompareBlockPos(const Block& a, const Block& b)
+    {
+        return a.blockPos.nPos < b.blockPos.nPos;
+    }
+
+    static bool CompareFiles(const std::pair<int, std::vector<Block> >& a, const std::pair<int, std::vector<Block> >& b)
+    {
+        return a.first < b.first;
+    }
+
+public:
+    CParallelIndexBuild(CIndexDB& dbIn, unsigned int nIndexes) :
+        db(dbIn), fAddress(nIndexes & INDEX_BUILD_ADDRESS), fSpent(nIndexes & INDEX_BUILD_SPENT),
+        nNextFile(0), nNextHeight(0), fFailed(false) {}
+
+    //! vBlocks are consecutive blocks of the active chain in height order
+
+    bool Run(const std::vector<const CBlockIndex*>& vBlocks, int nThreads, bool fProgress)
+    {
+        if (vBlocks.empty())
+            return true;
+
+        {
+            LOCK(cs_main);
+            std::map<int, std::vector<Block> > mapFiles;
+            BOOST_FOREACH(const CBlockIndex* pindex, vBlocks) {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA) || !(pindex->nStatus & BLOCK_HAVE_UNDO))
+                    return error("%s: block or undo data missing for %s", __func__, pindex->GetBlockHash().ToString());
+                Block b;
+                b.pindex = pindex;
+                b.blockPos = pindex->GetBlockPos();
+                b.undoPos = pindex->GetUndoPos();
+                mapFiles[b.blockPos.nFile].push_back(b);
+            }
+            for (std::map<int, std::vector<Block> >::iterator it = mapFiles.begin(); it != mapFiles.end(); it++) {
+                // vBlocks is ordered by height, so the first block added to a file is its lowest
+                int nLowestHeight = it->second.front().pindex->nHeight;
+                std::sort(it->second.begin(), it->second.end(), CompareBlockPos);
+                vFiles.push_back(std::make_pair(nLowestHeight, std::vector<Block>()));
+                vFiles.back().second.swap(it->second);
+            }
+            std::sort(vFiles.begin(), vFiles.end(), CompareFiles);
+        }
+        nNextHeight = vBlocks.front()->nHeight;
+
+        LogPrintf("%s: building indexes for %u blocks in %u files with %d threads\n", __func__, vBlocks.size(), vFiles.size(), nThreads);
+
+        boost::thread_group workers;
+        for (int i = 0; i < nThreads; i++)
+            workers.create_thread(boost::bind(&CParallelIndexBuild::Worker, this));
+
+        bool fOk = true;
+        try {
+            BOOST_FOREACH(const CBlockIndex* pindex, vBlocks) {
+                std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (!fFailed && !mapUnspent.count(pindex->nHeight))
+                        cond.wait(lock);
+                    if (fFailed)
+                        break;
+                    mapUnspent[pindex->nHeight].swap(addressUnspentIndex);
+                    mapUnspent.erase(pindex->nHeight);
+                    nNextHeight = pindex->nHeight + 1;
+                    cond.notify_all();
+                }
+                if (fAddress && !db.UpdateAddressUnspentIndex(addressUnspentIndex)) {
+                    fOk = error("%s: failed to write address unspent index", __func__);
+                    break;
+                }
+
+                if (fProgress) {
+                    LOCK(cs_main);
+                    pindexIndexBuild = pindex;
+                }
+                if (db.GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE)
+                    db.WriteIndexBatch();
+                if (pindex->nHeight % 10000 == 0)
+                    LogPrintf("%s: indexes built up to height %d\n", __func__, pindex->nHeight);
+            }
+        } catch (const boost::thread_interrupted&) {
+            workers.interrupt_all();
+            workers.join_all();
+            throw;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (!fOk)
+                fFailed = true;
+            cond.notify_all();
+        }
+        workers.join_all();
+        return fOk && !fFailed;
+    }
+};
+
+bool BuildIndexesParallel(CIndexDB& db, const std::vector<const CBlockIndex*>& vBlocks, unsigned int nIndexes, int nThreads, bool fProgress)
+{
+    CParallelIndexBuild build(db, nIndexes);
+    if (!build.Run(vBlocks, std::max(nThreads, 1), fProgress))
+        return false;
+
+    // Timestamps chain from one block to the next and need no block data.
+    if (nIndexes & INDEX_BUILD_TIMESTAMP) {
+        CValidationState state;
+        BOOST_FOREACH(const CBlockIndex* pindex, vBlocks)
+            if (!UpdateTimestampIndex(db, pindex, state))
+                return false;
+    }
+    return db.WriteIndexBatch();
+}
+
+static void StopIndexBuild()
+{
+    LOCK(cs_main);
+    nIndexBuildPending = 0;
+    pindexIndexBuild = NULL;
+}
+
+unsigned int GetMissingIndexes()
+{
+    unsigned int nIndexes = 0;
+    if (GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX) && !fAddressIndex)
+        nIndexes |= INDEX_BUILD_ADDRESS;
+    if (GetBoolArg("-spentindex", DEFAULT_SPENTINDEX) && !fSpentIndex)
+        nIndexes |= INDEX_BUILD_SPENT;
+    if (GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX) && !fTimestampIndex)
+        nIndexes |= INDEX_BUILD_TIMESTAMP;
+    return nIndexes;
+}
+
+bool GetIndexBuildProgress(unsigned int &nIndexes, int &nHeight)
+{
+    AssertLockHeld(cs_main);
+    if (nIndexBuildPending == 0 || pindexIndexBuild == NULL)
+        return false;
+    nIndexes = nIndexBuildPending;
+    nHeight = pindexIndexBuild->nHeight;
+    return true;
+}
+
+void ThreadBuildIndexes(unsigned int nIndexes)
+{
+    RenameThread("litecoinz-index");
+
+    // The genesis block is never indexed, so start after it unless an
+    // earlier build of the same indexes was interrupted.
+    const CBlockIndex* pindex = NULL;
+    {
+        LOCK(cs_main);
+        unsigned int nIndexesBuilt;
+        uint256 hashBuilt;
+        if (pindexdb->ReadIndexBuildState(nIndexesBuilt, hashBuilt) && nIndexesBuilt == nIndexes) {
+            BlockMap::iterator mi = mapBlockIndex.find(hashBuilt);
+            if (mi != mapBlockIndex.end())
+                pindex = mi->second;
+        }
+        if (pindex == NULL)
+            pindex = chainActive.Genesis();
+        if (pindex == NULL)
+            return;
+        nIndexBuildPending = nIndexes;
+        pindexIndexBuild = pindex;
+    }
+    LogPrintf("%s: building indexes in the background from height %d\n", __func__, pindex->nHeight);
+
+    // Far behind the tip, build the indexes with several threads that each
+    // read whole block files; the blocks connected meanwhile are applied one
+    // by one below.
+    int nThreads = GetArg("-indexbuildthreads", DEFAULT_INDEX_BUILD_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    if (nThreads > MAX_INDEX_BUILD_THREADS)
+        nThreads = MAX_INDEX_BUILD_THREADS;
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        if (nThreads > 1 && chainActive.Contains(pindex) && chainActive.Height() - pindex->nHeight >= MIN_PARALLEL_INDEX_BUILD_BLOCKS)
+            for (const CBlockIndex* pindexNext = chainActive.Next(pindex); pindexNext != NULL; pindexNext = chainActive.Next(pindexNext))
+                vBlocks.push_back(pindexNext);
+    }
+    if (!vBlocks.empty()) {
+        if (!BuildIndexesParallel(*pindexdb, vBlocks, nIndexes, nThreads, true)) {
+            error("%s: parallel index build failed", __func__);
+            StopIndexBuild();
+            return;
+        }
+        // The address deltas were written out of order, bypassing the
+        // balance index, so derive the balances from them afterwards.
+        if ((nIndexes & INDEX_BUILD_ADDRESS) && !pindexdb->BuildAddressBalanceIndex()) {
+            error("%s: failed to build address balance index", __func__);
+            StopIndexBuild();
+            return;
+        }
+        pindex = vBlocks.back();
+        pindexdb->WriteIndexBuildState(nIndexes, pindex->GetBlockHash());
+        if (!pindexdb->WriteIndexBatch(true)) {
+            error("%s: failed to write index build state", __func__);
+            StopIndexBuild();
+            return;
+        }
+        LogPrintf("%s: parallel index build done up to height %d\n", __func__, pindex->nHeight);
+    }
+
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        const CBlockIndex* pindexApply;
+        bool fUndo;
+        CDiskBlockPos blockPos;
+        CDiskBlockPos undoPos;
+        {
+            LOCK(cs_main);
+            if (chainActive.Contains(pindex)) {
+                pindexApply = chainActive.Next(pindex);
+                if (pindexApply == NULL) {
+                    // Caught up with the tip. Hand the indexes over to
+                    // ConnectBlock, which runs under cs_main as well.
+                    CValidationState state;
+                    pindexdb->WriteBestIndexedBlock(pindex->GetBlockHash());
+                    if (!pindexdb->WriteIndexBatch(true)) {
+                        AbortNode(state, "Failed to write index build state");
+                        return;
+                    }
+                    if (nIndexes & INDEX_BUILD_ADDRESS) {
+                        fAddressIndex = true;
+                        pindexdb->WriteFlag("addressindex", true);
+                        pindexdb->WriteFlag("addressbalanceindex", true);
+                        pindexdb->WriteFlag("addressindexscripts", true);
+                    }
+                    if (nIndexes & INDEX_BUILD_SPENT) {
+                        fSpentIndex = true;
+                        pindexdb->WriteFlag("spentindex", true);
+                    }
+                    if (nIndexes & INDEX_BUILD_TIMESTAMP) {
+                        fTimestampIndex = true;
+                        pindexdb->WriteFlag("timestampindex", true);
+                    }
+                    pindexdb->EraseIndexBuildState();
+                    if (!pindexdb->WriteIndexBatch(true)) {
+                        AbortNode(state, "Failed to write index build state");
+                        return;
+                    }
+                    nIndexBuildPending = 0;
+                    pindexIndexBuild = NULL;
+                    LogPrintf("%s: indexes built up to height %d\n", __func__, pindex->nHeight);
+                    return;
+                }
+                fUndo = false;
+            } else {
+                // The last block applied was disconnected by a reorg; undo it
+                // before following the new chain.
+                pindexApply = pindex;
+                fUndo = true;
+            }
+            if (!(pindexApply->nStatus & BLOCK_HAVE_DATA) || !(pindexApply->nStatus & BLOCK_HAVE_UNDO)) {
+                error("%s: block or undo data missing for %s, cannot build indexes", __func__, pindexApply->GetBlockHash().ToString());
+                nIndexBuildPending = 0;
+                pindexIndexBuild = NULL;
+                return;
+            }
+            blockPos = pindexApply->GetBlockPos();
+            undoPos = pindexApply->GetUndoPos();
         }
-    }
-    return fClean;
-}
 
-void static FlushBlockFile(bool fFinalize = false)
-{
-    LOCK(cs_LastBlockFile);
+        // Block and undo data are read without holding cs_main; if the chain
+        // moves on meanwhile, the next iteration undoes this block again.
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!ReadBlockFromDisk(block, blockPos, pindexApply->GetBlockHash()) ||
+            !UndoReadFromDisk(blockundo, undoPos, pindexApply->pprev->GetBlockHash()) ||
+            !BlockUndoMatches(block, blockundo)) {
+            error("%s: failed to read block or undo data for %s, cannot build indexes", __func__, pindexApply->GetBlockHash().ToString());
+            StopIndexBuild();
+            return;
+        }
 
-    CDiskBlockPos posOld(nLastBlockFile, 0);
+        CValidationState state;
+        if (!UpdateBlockIndexes(block, blockundo, pindexApply, nIndexes, fUndo, state))
+            return;
 
-    FILE *fileOld = OpenBlockFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
-    }
+        pindex = fUndo ? pindexApply->pprev : pindexApply;
+        pindexdb->WriteIndexBuildState(nIndexes, pindex->GetBlockHash());
+        if (pindexdb->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE)
+            pindexdb->WriteIndexBatch();
 
-    fileOld = OpenUndoFile(posOld);
-    if (fileOld) {
-        if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
-        FileCommit(fileOld);
-        fclose(fileOld);
+        {
+            LOCK(cs_main);
+            pindexIndexBuild = pindex;
+        }
+        if (pindex->nHeight % 10000 == 0)
+            LogPrintf("%s: indexes built up to height %d\n", __func__, pindex->nHeight);
     }
 }
 
-bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
-
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
-void ThreadScriptCheck() {
-    RenameThread("litecoinz-scriptch");
-    scriptcheckqueue.Thread();
-}
-
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2355,11 +3576,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in. The
+    // JoinSplit proofs are verified by the proof checks queued below.
+    if (!CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2397,6 +3618,24 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
+    // Verify the JoinSplit proofs of the whole block on the proof check
+    // threads while the transactions are connected below
+    CCheckQueueControl<CProofCheck> proofControl(fExpensiveChecks && nScriptCheckThreads ? &proofcheckqueue : NULL);
+    if (fExpensiveChecks) {
+        std::vector<CProofCheck> vProofChecks;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+            BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit)
+                vProofChecks.push_back(CProofCheck(joinsplit, tx.joinSplitPubKey, !fJustCheck));
+        if (nScriptCheckThreads) {
+            proofControl.Add(vProofChecks);
+        } else {
+            BOOST_FOREACH(CProofCheck& check, vProofChecks)
+                if (!check())
+                    return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                                     REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+        }
+    }
+
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
@@ -2405,9 +3644,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;	 
 
     // Construct the incremental merkle tree at the current
     // block position,
@@ -2430,7 +3666,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = block.vtx[i];
-        const uint256 txhash = tx.GetHash();
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2449,42 +3684,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 return state.DoS(100, error("ConnectBlock(): JoinSplit requirements not met"),
                                  REJECT_INVALID, "bad-txns-joinsplit-requirements-not-met");
 
-            if (fAddressIndex || fSpentIndex)
-            {
-                for (size_t j = 0; j < tx.vin.size(); j++) {
-
-                    const CTxIn input = tx.vin[j];
-                    const CTxOut &prevout = view.GetOutputFor(tx.vin[j]);
-                    uint160 hashBytes;
-                    int addressType;
-
-                    if (prevout.scriptPubKey.IsPayToScriptHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-                        addressType = 2;
-                    } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-                        hashBytes = uint160(vector <unsigned char>(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-                        addressType = 1;
-                    } else {
-                        hashBytes.SetNull();
-                        addressType = 0;
-                    }
-
-                    if (fAddressIndex && addressType > 0) {
-                        // record spending activity
-                        addressIndex.push_back(make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
-
-                        // remove address from unspent index
-                        addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
-                    }
-
-                    if (fSpentIndex) {
-                        // add the spent index to determine the txid and input that spent an output
-                        // and to find the amount and address from an input
-                        spentIndex.push_back(make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
-                    }
-                }
-
-            }
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
             // an incredibly-expensive-to-validate block.
@@ -2501,34 +3700,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
-        if (fAddressIndex) {
-            for (unsigned int k = 0; k < tx.vout.size(); k++) {
-                const CTxOut &out = tx.vout[k];
-
-                if (out.scriptPubKey.IsPayToScriptHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(2, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(2, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-                    vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-
-                    // record receiving activity
-                    addressIndex.push_back(make_pair(CAddressIndexKey(1, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                    // record unspent output
-                    addressUnspentIndex.push_back(make_pair(CAddressUnspentKey(1, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-                } else {
-                    continue;
-                }
-
-            }
-        }
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -2565,6 +3736,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (!control.Wait())
         return state.DoS(100, false);
+    if (!proofControl.Wait())
+        return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                         REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -2594,40 +3768,18 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
-    if (fAddressIndex) {
-        if (!pblocktree->WriteAddressIndex(addressIndex)) {
-            return AbortNode(state, "Failed to write address index");
-        }
-
-        if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-            return AbortNode(state, "Failed to write address unspent index");
-        }
-    }
-
-    if (fSpentIndex)
-        if (!pblocktree->UpdateSpentIndex(spentIndex))
-            return AbortNode(state, "Failed to write transaction index");
-
-    if (fTimestampIndex) {
-        unsigned int logicalTS = pindex->nTime;
-        unsigned int prevLogicalTS = 0;
-
-        // retrieve logical timestamp of the previous block
-        if (pindex->pprev)
-            if (!pblocktree->ReadTimestampBlockIndex(pindex->pprev->GetBlockHash(), prevLogicalTS))
-                LogPrintf("%s: Failed to read previous block's logical timestamp\n", __func__);
-
-        if (logicalTS <= prevLogicalTS) {
-            logicalTS = prevLogicalTS + 1;
-            LogPrintf("%s: Previous logical timestamp is newer Actual[%d] prevLogical[%d] Logical[%d]\n", __func__, pindex->nTime, prevLogicalTS, logicalTS);
-        }
+    if (!UpdateBlockIndexes(block, blockundo, pindex, GetEnabledIndexes(), false, state))
+        return false;
 
-        if (!pblocktree->WriteTimestampIndex(CTimestampIndexKey(logicalTS, pindex->GetBlockHash())))
-            return AbortNode(state, "Failed to write timestamp index");
+    // The index updates above are only queued; they are written out together
+    // with these markers by FlushStateToDisk.
+    if (fTxIndex)
+        if (!pblocktree->WriteBestIndexedBlock(pindex->GetBlockHash()))
+            return AbortNode(state, "Failed to write best indexed block");
+    if (fAddressIndex || fSpentIndex || fTimestampIndex)
+        if (!pindexdb->WriteBestIndexedBlock(pindex->GetBlockHash()))
+            return AbortNode(state, "Failed to write best indexed block");
 
-        if (!pblocktree->WriteTimestampBlockIndex(CTimestampBlockIndexKey(pindex->GetBlockHash()), CTimestampBlockIndexValue(logicalTS)))
-            return AbortNode(state, "Failed to write blockhash index");
-    }
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2652,6 +3804,17 @@ enum FlushStateMode {
     FLUSH_STATE_ALWAYS
 };
 
+/** Whether the queued index updates are held back until the next chainstate flush, guarded by cs_main */
+static bool fIndexBatchHeld = false;
+
+static void HoldIndexBatches(bool fHold)
+{
+    AssertLockHeld(cs_main);
+    pblocktree->HoldIndexBatch(fHold);
+    pindexdb->HoldIndexBatch(fHold);
+    fIndexBatchHeld = fHold;
+}
+
 /**
  * Update the on-disk chain state.
  * The caches and indexes are flushed depending on the mode we're called with
@@ -2697,8 +3860,24 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
     bool fPeriodicFlush = mode == FLUSH_STATE_PERIODIC && nNow > nLastFlush + (int64_t)DATABASE_FLUSH_INTERVAL * 1000000;
+    // Index updates of disconnected blocks are held back; flush them with the chainstate once the reorg is done.
+    bool fFlushHeldIndexes = mode == FLUSH_STATE_PERIODIC && fIndexBatchHeld;
     // Combine all conditions that result in a full cache flush.
-    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune;
+    bool fDoFullFlush = (mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fPeriodicFlush || fFlushForPrune || fFlushHeldIndexes;
+    // The queued index updates are over the limit, write them now.
+    bool fIndexBatchLarge = mode == FLUSH_STATE_IF_NEEDED &&
+        (pblocktree->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE || pindexdb->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE);
+    // Write the queued index updates. This happens no later than the chainstate
+    // flush below. Updates of connected blocks may be written ahead of it, as
+    // blocks connected again on restart rewrite the same index entries. Those
+    // of disconnected blocks are only written together with the chainstate:
+    // indexes left behind it by a crash are rolled forward by LoadBlockIndexDB.
+    if (fDoFullFlush || (!fIndexBatchHeld && (fPeriodicWrite || fIndexBatchLarge))) {
+        if (fIndexBatchHeld)
+            HoldIndexBatches(false);
+        if (!pblocktree->WriteIndexBatch() || !pindexdb->WriteIndexBatch())
+            return AbortNode(state, "Failed to write to index database");
+    }
     // Write blocks and block index to disk.
     if (fDoFullFlush || fPeriodicWrite) {
         // Depend on nMinDiskSpace to ensure we can write block index
@@ -2814,6 +3993,10 @@ bool static DisconnectTip(CValidationState &state) {
     CBlock block;
     if (!ReadBlockFromDisk(block, pindexDelete))
         return AbortNode(state, "Failed to read block");
+    // Keep the index updates of the disconnected block from reaching the
+    // database before the chainstate does.
+    if (!fIndexBatchHeld && (fTxIndex || fAddressIndex || fSpentIndex || fTimestampIndex || nIndexBuildPending != 0))
+        HoldIndexBatches(true);
     // Apply the block atomically to the chain state.
     uint256 anchorBeforeDisconnect = pcoinsTip->GetBestAnchor();
     int64_t nStart = GetTimeMicros();
@@ -2833,7 +4016,7 @@ bool static DisconnectTip(CValidationState &state) {
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true))
             mempool.remove(tx, removed, true);
     }
     if (anchorBeforeDisconnect != anchorAfterDisconnect) {
@@ -2859,6 +4042,7 @@ bool static DisconnectTip(CValidationState &state) {
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2873,11 +4057,13 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
     mempool.check(pcoinsTip);
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
-    CBlock block;
+    std::shared_ptr<const CBlock> pblockShared;
     if (!pblock) {
-        if (!ReadBlockFromDisk(block, pindexNew))
+        std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+        if (!ReadBlockFromDisk(*pblockRead, pindexNew))
             return AbortNode(state, "Failed to read block");
-        pblock = &block;
+        pblockShared = pblockRead;
+        pblock = pblockRead.get();
     }
     // Get the current commitment tree
     ZCIncrementalMerkleTree oldTree;
@@ -2886,6 +4072,9 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    PrefetchBlockInputs(*pblock);
+    int64_t nTime2a = GetTimeMicros(); nTimePrefetch += nTime2a - nTime2;
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTime2a - nTime2) * 0.001, nTimePrefetch * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
@@ -2896,8 +4085,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(pindexNew->GetBlockHash());
-        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
-        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2a;
+        LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2a) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
@@ -2913,6 +4102,10 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, const CB
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    // Keep the new tip in memory for the peers, notifiers and RPC calls that
+    // are about to ask for it
+    if (!IsInitialBlockDownload())
+        AddRecentBlock(pblockShared ? pblockShared : std::make_shared<const CBlock>(*pblock));
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH(const CTransaction &tx, txConflicted) {
@@ -3014,9 +4207,11 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
     const CBlockIndex *pindexFork = chainActive.FindFork(pindexMostWork);
 
     // Disconnect active blocks which are no longer in the best chain.
+    bool fBlocksDisconnected = false;
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
         if (!DisconnectTip(state))
             return false;
+        fBlocksDisconnected = true;
     }
 
     // Build list of new blocks to connect.
@@ -3062,6 +4257,11 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
         }
     }
 
+    // The transactions of the disconnected blocks went back into the
+    // mempool without a size limit; trim it once the reorg is done
+    if (fBlocksDisconnected)
+        mempool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+
     // Callbacks/notifications for a new best chain.
     if (fInvalidFound)
         CheckForkWarningConditionsOnNewFork(vpindexToConnect.back());
@@ -3792,6 +4992,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        mappedBlockFiles.Erase(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3913,6 +5114,88 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/**
+ * Bring the transaction index (fTx) or nIndexes from hashBestIndexed to the
+ * chainstate tip. A crash can leave the indexes behind the chainstate, or
+ * with the updates of connected blocks the chainstate never got, on a
+ * branch it has since left; those are disconnected back to the fork with
+ * the active chain first.
+ */
+static bool RollForwardIndexes(const uint256& hashBestIndexed, bool fTx, unsigned int nIndexes)
+{
+    BlockMap::iterator mi = mapBlockIndex.find(hashBestIndexed);
+    if (mi == mapBlockIndex.end() || mi->second == chainActive.Tip())
+        return true;
+
+    CValidationState state;
+    const CBlockIndex* pindexFork = mi->second;
+    if (!chainActive.Contains(pindexFork)) {
+        LogPrintf("%s: %s at %s is not on the active chain, disconnecting back to height %d\n", __func__,
+                  fTx ? "transaction index" : "index database", hashBestIndexed.ToString(),
+                  chainActive.FindFork(pindexFork)->nHeight);
+        uiInterface.InitMessage(_("Rolling indexes back..."));
+        for (; !chainActive.Contains(pindexFork); pindexFork = pindexFork->pprev) {
+            // Transaction index entries are kept when a block is
+            // disconnected, so only its marker has to move.
+            if (fTx)
+                continue;
+            CBlock block;
+            CBlockUndo blockundo;
+            if (!(pindexFork->nStatus & BLOCK_HAVE_UNDO) ||
+                !ReadBlockFromDisk(block, pindexFork) ||
+                !UndoReadFromDisk(blockundo, pindexFork->GetUndoPos(), pindexFork->pprev->GetBlockHash()) ||
+                !BlockUndoMatches(block, blockundo))
+                return error("%s: failed to read block or undo data for %s, you need to rebuild the database using -reindex", __func__, pindexFork->GetBlockHash().ToString());
+            if (!UpdateBlockIndexes(block, blockundo, pindexFork, nIndexes, true, state) ||
+                !pindexdb->WriteBestIndexedBlock(pindexFork->pprev->GetBlockHash()))
+                return error("%s: failed to write indexes", __func__);
+            if (pindexdb->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE && !pindexdb->WriteIndexBatch())
+                return error("%s: failed to write indexes", __func__);
+        }
+        if (fTx ? !pblocktree->WriteBestIndexedBlock(pindexFork->GetBlockHash()) || !pblocktree->WriteIndexBatch(true)
+                : !pindexdb->WriteIndexBatch(true))
+            return error("%s: failed to write indexes", __func__);
+        if (pindexFork == chainActive.Tip())
+            return true;
+    }
+
+    LogPrintf("%s: %s at height %d is behind the chainstate, applying blocks up to height %d\n", __func__,
+              fTx ? "transaction index" : "index database", pindexFork->nHeight, chainActive.Height());
+    uiInterface.InitMessage(_("Rolling indexes forward..."));
+    for (const CBlockIndex* pindex = chainActive.Next(pindexFork); pindex != NULL; pindex = chainActive.Next(pindex)) {
+        CBlock block;
+        CBlockUndo blockundo;
+        if (!(pindex->nStatus & BLOCK_HAVE_UNDO) ||
+            !ReadBlockFromDisk(block, pindex) ||
+            !UndoReadFromDisk(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()) ||
+            !BlockUndoMatches(block, blockundo))
+            return error("%s: failed to read block or undo data for %s, you need to rebuild the database using -reindex", __func__, pindex->GetBlockHash().ToString());
+
+        if (fTx) {
+            CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+            std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+            vPos.reserve(block.vtx.size());
+            BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+                vPos.push_back(std::make_pair(tx.GetHash(), pos));
+                pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            }
+            if (!pblocktree->WriteTxIndex(vPos) || !pblocktree->WriteBestIndexedBlock(pindex->GetBlockHash()))
+                return error("%s: failed to write transaction index", __func__);
+            if (pblocktree->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE && !pblocktree->WriteIndexBatch())
+                return error("%s: failed to write transaction index", __func__);
+        } else {
+            if (!UpdateBlockIndexes(block, blockundo, pindex, nIndexes, false, state) ||
+                !pindexdb->WriteBestIndexedBlock(pindex->GetBlockHash()))
+                return error("%s: failed to write indexes", __func__);
+            if (pindexdb->GetIndexBatchSize() > MAX_INDEX_BATCH_SIZE && !pindexdb->WriteIndexBatch())
+                return error("%s: failed to write indexes", __func__);
+        }
+    }
+    if (fTx ? !pblocktree->WriteIndexBatch(true) : !pindexdb->WriteIndexBatch(true))
+        return error("%s: failed to write indexes", __func__);
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
@@ -4014,16 +5297,47 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Move the address, spent and timestamp indexes out of the block tree
+    // database, and entries written with fixed-width keys to the compact
+    // key format
+    uiInterface.InitMessage(_("Upgrading index keys..."));
+    if (!pindexdb->MoveFromBlockTree(*pblocktree))
+        return error("%s: failed to move indexes to the index database", __func__);
+    if (!pindexdb->UpgradeIndexKeys())
+        return error("%s: failed to upgrade index keys", __func__);
+
     // Check whether we have an address index
-    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    pindexdb->ReadFlag("addressindex", fAddressIndex);
     LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
 
+    // Build the address balances for address indexes created without them
+    if (fAddressIndex) {
+        bool fAddressBalanceIndex = false;
+        pindexdb->ReadFlag("addressbalanceindex", fAddressBalanceIndex);
+        if (!fAddressBalanceIndex) {
+            LogPrintf("%s: building address balance index...\n", __func__);
+            uiInterface.InitMessage(_("Building address balance index..."));
+            if (!pindexdb->BuildAddressBalanceIndex())
+                return error("%s: failed to build address balance index", __func__);
+            pindexdb->WriteFlag("addressbalanceindex", true);
+        }
+
+        // Address indexes created before non-standard scripts and shielded
+        // pool flows were indexed are rebuilt by ThreadBuildIndexes.
+        bool fAddressIndexScripts = false;
+        pindexdb->ReadFlag("addressindexscripts", fAddressIndexScripts);
+        if (!fAddressIndexScripts) {
+            LogPrintf("%s: address index lacks script and shielded pool entries and needs to be rebuilt\n", __func__);
+            fAddressIndex = false;
+        }
+    }
+
     // Check whether we have a timestamp index
-    pblocktree->ReadFlag("timestampindex", fTimestampIndex);
+    pindexdb->ReadFlag("timestampindex", fTimestampIndex);
     LogPrintf("%s: timestamp index %s\n", __func__, fTimestampIndex ? "enabled" : "disabled");
 
     // Check whether we have a spent index
-    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    pindexdb->ReadFlag("spentindex", fSpentIndex);
     LogPrintf("%s: spent index %s\n", __func__, fSpentIndex ? "enabled" : "disabled");
     // Fill in-memory data
     BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
@@ -4047,6 +5361,15 @@ bool static LoadBlockIndexDB()
     // Set hashAnchorEnd for the end of best chain
     it->second->hashAnchorEnd = pcoinsTip->GetBestAnchor();
 
+    // Bring indexes left out of step with the chainstate by a crash up to its tip
+    uint256 hashBestIndexed;
+    if (fTxIndex && pblocktree->ReadBestIndexedBlock(hashBestIndexed))
+        if (!RollForwardIndexes(hashBestIndexed, true, 0))
+            return false;
+    if ((fAddressIndex || fSpentIndex || fTimestampIndex) && pindexdb->ReadBestIndexedBlock(hashBestIndexed))
+        if (!RollForwardIndexes(hashBestIndexed, false, GetEnabledIndexes()))
+            return false;
+
     PruneBlockIndexCandidates();
 
     LogPrintf("%s: hashBestChain=%s height=%d date=%s progress=%f\n", __func__,
@@ -4205,14 +5528,16 @@ bool InitBlockIndex() {
 
     // Use the provided setting for -addressindex in the new database
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
-    pblocktree->WriteFlag("addressindex", fAddressIndex);
+    pindexdb->WriteFlag("addressindex", fAddressIndex);
+    pindexdb->WriteFlag("addressbalanceindex", fAddressIndex);
+    pindexdb->WriteFlag("addressindexscripts", fAddressIndex);
 
     // Use the provided setting for -timestampindex in the new database
     fTimestampIndex = GetBoolArg("-timestampindex", DEFAULT_TIMESTAMPINDEX);
-    pblocktree->WriteFlag("timestampindex", fTimestampIndex);
+    pindexdb->WriteFlag("timestampindex", fTimestampIndex);
 
     fSpentIndex = GetBoolArg("-spentindex", DEFAULT_SPENTINDEX);
-    pblocktree->WriteFlag("spentindex", fSpentIndex);
+    pindexdb->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -4590,8 +5915,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -4605,38 +5928,63 @@ void static ProcessGetData(CNode* pfrom)
             if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
             {
                 bool send = false;
-                BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                CBlockIndex* pindex = NULL;
+                CDiskBlockPos blockPos;
                 {
-                    if (chainActive.Contains(mi->second)) {
-                        send = true;
-                    } else {
-                        static const int nOneMonth = 30 * 24 * 60 * 60;
-                        // To prevent fingerprinting attacks, only send blocks outside of the active
-                        // chain if they are valid, and no more than a month older (both in time, and in
-                        // best equivalent proof of work) than the best header chain we know about.
-                        send = mi->second->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
-                            (pindexBestHeader->GetBlockTime() - mi->second->GetBlockTime() < nOneMonth) &&
-                            (GetBlockProofEquivalentTime(*pindexBestHeader, *mi->second, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
-                        if (!send) {
-                            LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                    {
+                        pindex = mi->second;
+                        if (chainActive.Contains(pindex)) {
+                            send = true;
+                        } else {
+                            static const int nOneMonth = 30 * 24 * 60 * 60;
+                            // To prevent fingerprinting attacks, only send blocks outside of the active
+                            // chain if they are valid, and no more than a month older (both in time, and in
+                            // best equivalent proof of work) than the best header chain we know about.
+                            send = pindex->IsValid(BLOCK_VALID_SCRIPTS) && (pindexBestHeader != NULL) &&
+                                (pindexBestHeader->GetBlockTime() - pindex->GetBlockTime() < nOneMonth) &&
+                                (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, Params().GetConsensus()) < nOneMonth);
+                            if (!send) {
+                                LogPrintf("%s: ignoring request from peer=%i for old block that isn't in the main chain\n", __func__, pfrom->GetId());
+                            }
                         }
                     }
+                    // Pruned nodes may have deleted the block, so check whether
+                    // it's available before trying to send.
+                    send = send && (pindex->nStatus & BLOCK_HAVE_DATA);
+                    if (send)
+                        blockPos = pindex->GetBlockPos();
                 }
-                // Pruned nodes may have deleted the block, so check whether
-                // it's available before trying to send.
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
+                if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
+                    // Send a recently connected block from memory, otherwise
+                    // from disk. The block was checked when it was stored, so
+                    // a full block goes out as the bytes on disk, read
+                    // without cs_main.
+                    bool fRead;
                     if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    {
+                        std::shared_ptr<const CDataStream> pssBlock = GetRecentBlockBytes(inv.hash);
+                        if (pssBlock) {
+                            fRead = true;
+                            pfrom->PushMessage("block", *pssBlock);
+                        } else {
+                            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+                            fRead = ReadRawBlockFromDisk(ssBlock, blockPos, Params().MessageStart());
+                            if (fRead)
+                                pfrom->PushMessage("block", ssBlock);
+                        }
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        std::shared_ptr<const CBlock> pblockRecent = GetRecentBlock(inv.hash);
+                        CBlock blockRead;
+                        fRead = pblockRecent || ReadBlockFromDisk(blockRead, blockPos, inv.hash);
+                        const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
                         LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        if (fRead && pfrom->pfilter)
                         {
                             CMerkleBlock merkleBlock(block, *pfrom->pfilter);
                             pfrom->PushMessage("merkleblock", merkleBlock);
@@ -4655,8 +6003,18 @@ void static ProcessGetData(CNode* pfrom)
                             // no response
                     }
 
+                    LOCK(cs_main);
+                    if (!fRead)
+                    {
+                        // Only pruning, which may have run since cs_main was
+                        // released, is allowed to take the block away
+                        if (pindex->nStatus & BLOCK_HAVE_DATA)
+                            assert(!"cannot load block from disk");
+                        vNotFound.push_back(inv);
+                    }
+
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
-                    if (inv.hash == pfrom->hashContinue)
+                    else if (inv.hash == pfrom->hashContinue)
                     {
                         // Bypass PushInventory, this must send even if redundant,
                         // and we want it right after the last block so they don't
@@ -4717,6 +6075,244 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/**
+ * Accept a transaction relayed by pfrom to the mempool, given the outcome of
+ * PreCheckTransaction, then relay it and the orphans it made acceptable, or
+ * reject it and punish pfrom if it was invalid.
+ */
+static void AcceptRelayedTransaction(CNode* pfrom, const CTransaction& tx, const CValidationState& statePreCheck)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    CValidationState state;
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    bool fAlreadyHave = AlreadyHave(inv);
+    if (!fAlreadyHave && !statePreCheck.IsValid())
+        state = statePreCheck;
+
+    if (!fAlreadyHave && state.IsValid() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits from entering mapOrphans
+    else if (fMissingInputs && tx.vjoinsplit.size() == 0)
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+/** A relayed transaction waiting for the acceptance threads, holding a reference on the peer that sent it */
+struct CTxAcceptRequest
+{
+    CTransaction tx;
+    CNode* pfrom;
+    //! Position among the transactions received from pfrom
+    uint64_t nSequence;
+};
+
+static boost::mutex csTxAcceptQueue;
+static boost::condition_variable condTxAcceptQueue;
+static std::deque<CTxAcceptRequest> queueTxAccept;
+static int nTxAcceptThreads = 0;
+/**
+ * Per peer, the sequence number of the next transaction received and of the
+ * next one to commit. A peer's transactions are checked in parallel but
+ * committed in the order they arrived, so that a child never reaches
+ * AcceptToMemoryPool before its parent; JoinSplit transactions cannot wait
+ * for their parents as orphans.
+ */
+static std::map<NodeId, std::pair<uint64_t, uint64_t> > mapTxAcceptSequence;
+static boost::condition_variable condTxAcceptCommit;
+
+/** Let the next transaction received from a peer be committed */
+static void EndTxAcceptCommit(NodeId id)
+{
+    boost::unique_lock<boost::mutex> lock(csTxAcceptQueue);
+    std::pair<uint64_t, uint64_t>& sequence = mapTxAcceptSequence[id];
+    if (++sequence.second == sequence.first)
+        mapTxAcceptSequence.erase(id);
+    condTxAcceptCommit.notify_all();
+}
+
+/** Check a relayed transaction without cs_main, then take it for the short commit phase in the peer's order */
+static void ProcessRelayedTransaction(const CTxAcceptRequest& request)
+{
+    // Don't spend a proof check on transactions that are already known,
+    // e.g. orphans or recent rejects relayed again
+    bool fAlreadyHave;
+    {
+        LOCK(cs_main);
+        fAlreadyHave = AlreadyHave(CInv(MSG_TX, request.tx.GetHash()));
+    }
+
+    CValidationState statePreCheck;
+    try {
+        if (!fAlreadyHave)
+            PreCheckTransaction(mempool, statePreCheck, request.tx);
+    } catch (const std::exception& e) {
+        // AcceptToMemoryPool does all the checks again
+        PrintExceptionContinue(&e, "ProcessRelayedTransaction()");
+        statePreCheck = CValidationState();
+    }
+
+    NodeId id = request.pfrom->GetId();
+    {
+        boost::unique_lock<boost::mutex> lock(csTxAcceptQueue);
+        while (mapTxAcceptSequence[id].second != request.nSequence)
+            condTxAcceptCommit.wait(lock);
+    }
+    try {
+        AcceptRelayedTransaction(request.pfrom, request.tx, statePreCheck);
+    } catch (...) {
+        EndTxAcceptCommit(id);
+        throw;
+    }
+    EndTxAcceptCommit(id);
+}
+
+void ThreadTxAccept()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(csTxAcceptQueue);
+        nTxAcceptThreads++;
+    }
+    while (true) {
+        CTxAcceptRequest request;
+        {
+            boost::unique_lock<boost::mutex> lock(csTxAcceptQueue);
+            while (queueTxAccept.empty())
+                condTxAcceptQueue.wait(lock);
+            request = queueTxAccept.front();
+            queueTxAccept.pop_front();
+        }
+        // Handle exceptions as ProcessMessages does for the transactions it
+        // checks itself, and always drop the reference on the peer
+        try {
+            ProcessRelayedTransaction(request);
+        } catch (const boost::thread_interrupted&) {
+            LOCK(cs_vNodes);
+            request.pfrom->Release();
+            throw;
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxAccept()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadTxAccept()");
+        }
+        {
+            LOCK(cs_vNodes);
+            request.pfrom->Release();
+        }
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5111,131 +6707,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx")
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        // Hand the transaction to the acceptance threads, so that verifying
+        // it does not hold up this peer's other messages. When they fall
+        // behind, check it here, which slows down a peer flooding us.
+        CTxAcceptRequest request;
+        request.tx = tx;
+        request.pfrom = pfrom;
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+            boost::unique_lock<boost::mutex> lock(csTxAcceptQueue);
+            request.nSequence = mapTxAcceptSequence[pfrom->GetId()].first++;
+            if (nTxAcceptThreads > 0 && queueTxAccept.size() < MAX_TX_ACCEPT_QUEUE) {
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits from entering mapOrphans
-        else if (fMissingInputs && tx.vjoinsplit.size() == 0)
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+                    LOCK(cs_vNodes);
+                    pfrom->AddRef();
                 }
+                queueTxAccept.push_back(request);
+                condTxAcceptQueue.notify_one();
+                return true;
             }
         }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
-        }
+        ProcessRelayedTransaction(request);
     }
 
 
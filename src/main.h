@@ -31,6 +31,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -41,8 +42,10 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CIndexDB;
 class CBloomFilter;
 class CInv;
+class CProofCheck;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -66,16 +69,36 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Maximum number of blk?????.dat and rev?????.dat files kept memory-mapped for reading */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 64;
+/** Number of blocks last connected to the active chain that are kept in memory */
+static const unsigned int MAX_RECENT_BLOCKS = 8;
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Maximum number of transaction acceptance threads allowed */
+static const int MAX_TX_ACCEPT_THREADS = 16;
+/** -txacceptthreads default (number of threads accepting relayed transactions, 0 = auto) */
+static const int DEFAULT_TX_ACCEPT_THREADS = 0;
+/** Number of relayed transactions waiting for the acceptance threads above which the message handler checks them itself */
+static const unsigned int MAX_TX_ACCEPT_QUEUE = 1000;
+/** -maxproofcachesize default (number of verified JoinSplit proofs remembered) */
+static const unsigned int DEFAULT_MAX_PROOF_CACHE_SIZE = 20000;
+/** Maximum number of background index building threads allowed */
+static const int MAX_INDEX_BUILD_THREADS = 16;
+/** -indexbuildthreads default (number of background index building threads, 0 = auto) */
+static const int DEFAULT_INDEX_BUILD_THREADS = 0;
+/** Number of blocks missing from the indexes above which they are built with several threads */
+static const int MIN_PARALLEL_INDEX_BUILD_BLOCKS = 2000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -101,8 +124,11 @@ static const int64_t BLOCK_DOWNLOAD_TIMEOUT_PER_PEER = 500000;
 static const bool DEFAULT_ADDRESSINDEX = false;
 static const bool DEFAULT_TIMESTAMPINDEX = false;
 static const bool DEFAULT_SPENTINDEX = false;
+/** Size (in bytes) of queued index updates above which they are written out before the next periodic flush */
+static const size_t MAX_INDEX_BATCH_SIZE = 64 << 20;
 static const unsigned int DEFAULT_DB_MAX_OPEN_FILES = 1000;
 static const bool DEFAULT_DB_COMPRESSION = true;												
+static const unsigned int DEFAULT_INDEXDB_MAX_OPEN_FILES = 1000;
 
 // Sanity check the magic numbers when we change them
 BOOST_STATIC_ASSERT(DEFAULT_BLOCK_MAX_SIZE <= MAX_BLOCK_SIZE);
@@ -213,6 +239,30 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the JoinSplit proof checking thread */
+void ThreadProofCheck();
+/** Run an instance of the coins prefetch thread */
+void ThreadPrefetchInputs();
+/** Run an instance of the relayed transaction acceptance thread */
+void ThreadTxAccept();
+/** Indexes that can be built in the background instead of requiring -reindex */
+enum IndexBuildFlags {
+    INDEX_BUILD_ADDRESS   = (1U << 0),
+    INDEX_BUILD_SPENT     = (1U << 1),
+    INDEX_BUILD_TIMESTAMP = (1U << 2),
+};
+/** Return the indexes enabled on the command line that the block tree database does not have yet */
+unsigned int GetMissingIndexes();
+/** Build the given indexes by walking the active chain, then hand them over to ConnectBlock */
+void ThreadBuildIndexes(unsigned int nIndexes);
+/**
+ * Write the address, spent and timestamp index entries of consecutive active
+ * chain blocks to db, with nThreads threads that each read whole block files.
+ * Unlike ThreadBuildIndexes this leaves the address balance index alone.
+ */
+bool BuildIndexesParallel(CIndexDB& db, const std::vector<const CBlockIndex*>& vBlocks, unsigned int nIndexes, int nThreads, bool fProgress = false);
+/** Return the indexes being built in the background and the height reached so far; false if no build is running */
+bool GetIndexBuildProgress(unsigned int &nIndexes, int &nHeight);
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -258,9 +308,24 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/**
+ * (try to) add transaction to memory pool; fOverrideMempoolLimit skips trimming it to -maxmempool.
+ * The inputs are looked up in pcoinsView, or in pcoinsTip if it is NULL.
+ **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false,
+                        CCoinsView* pcoinsView=NULL);
+
+/**
+ * Run the expensive checks of AcceptToMemoryPool without holding cs_main:
+ * the context-free checks and JoinSplit proofs, then the scripts against a
+ * snapshot of the inputs. Verified proofs and signatures are cached, so a
+ * following AcceptToMemoryPool only re-validates the inputs under cs_main.
+ * Returns false only if the transaction is invalid whatever the mempool and
+ * chain state; missing inputs are left to AcceptToMemoryPool. pcoinsView is
+ * used as in AcceptToMemoryPool.
+ */
+bool PreCheckTransaction(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, CCoinsView* pcoinsView=NULL);
 
 
 struct CNodeStateStats {
@@ -390,6 +455,51 @@ struct CTimestampBlockIndexValue {
     }
 };
 
+/**
+ * Output, input and transaction positions in the address and spent index
+ * keys are stored in an order-preserving compact form: values below 0xF0 as
+ * a single byte, larger ones as 0xF0 + n followed by n big-endian bytes.
+ */
+inline unsigned int GetIndexKeyIntSize(uint32_t n)
+{
+    if (n < 0xF0)
+        return 1;
+    unsigned int nBytes = 1;
+    while (nBytes < 4 && (n >> (8 * nBytes)) != 0)
+        nBytes++;
+    return 1 + nBytes;
+}
+
+template<typename Stream>
+void WriteIndexKeyInt(Stream& s, uint32_t n)
+{
+    unsigned int nSize = GetIndexKeyIntSize(n);
+    if (nSize == 1) {
+        ser_writedata8(s, n);
+        return;
+    }
+    ser_writedata8(s, 0xF0 + nSize - 1);
+    for (int i = nSize - 2; i >= 0; i--)
+        ser_writedata8(s, (n >> (8 * i)) & 0xFF);
+}
+
+template<typename Stream>
+uint32_t ReadIndexKeyInt(Stream& s)
+{
+    uint8_t ch = ser_readdata8(s);
+    if (ch < 0xF0)
+        return ch;
+    unsigned int nBytes = ch - 0xF0;
+    if (nBytes == 0 || nBytes > 4)
+        throw std::ios_base::failure("ReadIndexKeyInt(): invalid length");
+    uint32_t n = 0;
+    for (unsigned int i = 0; i < nBytes; i++)
+        n = (n << 8) | ser_readdata8(s);
+    if (GetIndexKeyIntSize(n) != nBytes + 1)
+        throw std::ios_base::failure("ReadIndexKeyInt(): non-canonical encoding");
+    return n;
+}
+
 struct CAddressUnspentKey {
     unsigned int type;
     uint160 hashBytes;
@@ -397,21 +507,21 @@ struct CAddressUnspentKey {
     size_t index;
 
     size_t GetSerializeSize(int nType, int nVersion) const {
-        return 57;
+        return 53 + GetIndexKeyIntSize(index);
     }
     template<typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const {
         ser_writedata8(s, type);
         hashBytes.Serialize(s, nType, nVersion);
         txhash.Serialize(s, nType, nVersion);
-        ser_writedata32(s, index);
+        WriteIndexKeyInt(s, index);
     }
     template<typename Stream>
     void Unserialize(Stream& s, int nType, int nVersion) {
         type = ser_readdata8(s);
         hashBytes.Unserialize(s, nType, nVersion);
         txhash.Unserialize(s, nType, nVersion);
-        index = ser_readdata32(s);
+        index = ReadIndexKeyInt(s);
     }
 
     CAddressUnspentKey(unsigned int addressType, uint160 addressHash, uint256 txid, size_t indexValue) {
@@ -478,7 +588,7 @@ struct CAddressIndexKey {
     bool spending;
 
     size_t GetSerializeSize(int nType, int nVersion) const {
-        return 66;
+        return 58 + GetIndexKeyIntSize(txindex) + GetIndexKeyIntSize(index);
     }
     template<typename Stream>
     void Serialize(Stream& s, int nType, int nVersion) const {
@@ -486,9 +596,9 @@ struct CAddressIndexKey {
         hashBytes.Serialize(s, nType, nVersion);
         // Heights are stored big-endian for key sorting in LevelDB
         ser_writedata32be(s, blockHeight);
-        ser_writedata32be(s, txindex);
+        WriteIndexKeyInt(s, txindex);
         txhash.Serialize(s, nType, nVersion);
-        ser_writedata32(s, index);
+        WriteIndexKeyInt(s, index);
         char f = spending;
         ser_writedata8(s, f);
     }
@@ -497,9 +607,9 @@ struct CAddressIndexKey {
         type = ser_readdata8(s);
         hashBytes.Unserialize(s, nType, nVersion);
         blockHeight = ser_readdata32be(s);
-        txindex = ser_readdata32be(s);
+        txindex = ReadIndexKeyInt(s);
         txhash.Unserialize(s, nType, nVersion);
-        index = ser_readdata32(s);
+        index = ReadIndexKeyInt(s);
         char f = ser_readdata8(s);
         spending = f;
     }
@@ -601,6 +711,7 @@ struct CAddressIndexIteratorHeightKey {
         blockHeight = 0;
     }
 };
+
 struct CDiskTxPos : public CDiskBlockPos
 {
     unsigned int nTxOffset; // after header
@@ -677,8 +788,13 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
 
-/** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
+/**
+ * Context-independent validity checks. With fProofCache set, JoinSplit proofs
+ * found in the proof cache are not verified again and the ones verified are
+ * added to it, which only makes sense with a Strict verifier.
+ */
+bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier,
+                      bool fProofCache = false);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
 
 /** Check for standard transaction types
@@ -735,18 +851,67 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing one JoinSplit proof check, queued by ConnectBlock
+ * so the proofs of a block are verified in parallel. Proofs already verified
+ * when their transaction entered the mempool are taken from the proof cache.
+ */
+class CProofCheck
+{
+private:
+    const JSDescription *pjoinsplit;
+    uint256 joinSplitPubKey;
+    //! Remove the proof from the cache; only for blocks actually connected
+    bool fCacheErase;
+
+public:
+    CProofCheck(): pjoinsplit(0), fCacheErase(false) {}
+    CProofCheck(const JSDescription& joinsplitIn, const uint256& joinSplitPubKeyIn, bool fCacheEraseIn) :
+        pjoinsplit(&joinsplitIn), joinSplitPubKey(joinSplitPubKeyIn), fCacheErase(fCacheEraseIn) { }
+
+    bool operator()();
+
+    void swap(CProofCheck &check) {
+        std::swap(pjoinsplit, check.pjoinsplit);
+        std::swap(joinSplitPubKey, check.joinSplitPubKey);
+        std::swap(fCacheErase, check.fCacheErase);
+    }
+};
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes);
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(uint160 addressHash, int type,
                      std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                     int start = 0, int end = 0);
+                     int start = 0, int end = 0,
+                     const CAddressIndexKey *pkeyAfter = NULL, size_t nLimit = 0);
 bool GetAddressUnspent(uint160 addressHash, int type,
                        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs);
+bool GetAddressBalance(uint160 addressHash, int type, CAmount &balance, CAmount &received);
+/** Get the address index type and hash a scriptPubKey is indexed under; false for empty and unspendable scripts */
+bool GetScriptAddressIndex(const CScript& script, int& addressType, uint160& hashBytes);
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+/** Read a block that was validated before it was stored, checking it against its hash instead of its proof of work */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/**
+ * Read the serialized bytes of a block as they are stored on disk, which
+ * are also its network serialization. The block is neither deserialized
+ * nor checked, and no lock is needed.
+ */
+bool ReadRawBlockFromDisk(CDataStream& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+/** Start reading the given blocks into the OS page cache in the background */
+void PrefetchBlocksFromDisk(const std::vector<const CBlockIndex*>& vBlocks);
+/**
+ * Get a block recently connected to the active chain from memory, or NULL if
+ * it isn't one of the last MAX_RECENT_BLOCKS blocks. Blocks are not cached
+ * during initial block download.
+ */
+std::shared_ptr<const CBlock> GetRecentBlock(const uint256& hash);
+/** Get the network serialization of a block that GetRecentBlock returns, or NULL */
+std::shared_ptr<const CDataStream> GetRecentBlockBytes(const uint256& hash);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -865,6 +1030,12 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/**
+ * Global variable that points to the address, spent and timestamp index database.
+ * It may be read without cs_main; its queued updates are guarded by its own lock.
+ */
+extern CIndexDB *pindexdb;
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -35,7 +35,6 @@
 #include "sodium.h"
 
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
@@ -48,68 +47,81 @@ using namespace std;
 // BitcoinMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// The priority phase sorts transactions by priority, then fee rate:
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByAncestorFee()(*(b.second), *(a.second)); //Reverse order to make sort less than
+        return a.first < b.first;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Packages are added parents first
+class CompareByAncestorCount
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
     }
 };
 
+// Stop looking for packages once this many in a row did not fit in a nearly full block
+static const int MAX_CONSECUTIVE_FAILURES = 1000;
+
 void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast()+1, GetAdjustedTime());
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+// Fills a block template from the mempool on top of a view of the coins
+// at the tip it builds on. The view and the totals are kept with the
+// template so that transactions can be appended to it later.
+class CBlockAssembler
+{
+public:
+    std::unique_ptr<CBlockTemplate> pblocktemplate;
+    CBlockIndex* pindexPrev;
+    CCoinsViewCache view;
+    int nHeight;
+    int64_t nLockTimeCutoff;
+
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+    bool fPrintPriority;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+    // Lowest package fee rate taken in the fee phase
+    CFeeRate feeRateLowest;
+
+    std::set<uint256> setInBlock;
+
+    CBlockAssembler(CBlockIndex* pindexPrevIn);
+
+    /** Add a transaction whose in-mempool parents are all in the block already, if it fits and is valid on top of the block so far */
+    bool AddToBlock(const CTxMemPoolEntry& entry, double dPriority);
+    /** Run the priority phase and then the fee phase over the whole mempool */
+    void AddMempoolTransactions();
+    /** Create the coinbase, fill in the header and check the block */
+    void FinishBlock(const CScript& scriptPubKeyIn);
+    /** Pay the fees of the transactions added so far in the coinbase */
+    void UpdateCoinbase();
+};
+
+CBlockAssembler::CBlockAssembler(CBlockIndex* pindexPrevIn) :
+    pblocktemplate(new CBlockTemplate()), pindexPrev(pindexPrevIn), view(pcoinsTip)
 {
-    const CChainParams& chainparams = Params();
-    // Create new block
-    std::unique_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
     CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
     // -regtest only: allow overriding block.nVersion with
@@ -123,255 +135,383 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
     // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
     nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
     // How much of the block should be dedicated to high-priority transactions,
     // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
     nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
     // Minimum block size you want to create; block will be filled with free transactions
     // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
     nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    fPrintPriority = GetBoolArg("-printpriority", false);
 
-    {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        pblock->nTime = GetAdjustedTime();
-        const int64_t nMedianTimePast = pindexPrev->GetMedianTimePast();
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->second.GetTx();
-
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
-
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
-                continue;
+    nHeight = pindexPrev->nHeight + 1;
+    pblock->nTime = GetAdjustedTime();
+    nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                    ? pindexPrev->GetMedianTimePast()
+                    : pblock->GetBlockTime();
 
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+    nBlockSize = 1000;
+    nBlockTx = 0;
+    nBlockSigOps = 100;
+    nFees = 0;
+}
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+bool CBlockAssembler::AddToBlock(const CTxMemPoolEntry& entry, double dPriority)
+{
+    const CTransaction& tx = entry.GetTx();
+    if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff))
+        return false;
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    // Size limits
+    unsigned int nTxSize = entry.GetTxSize();
+    if (nBlockSize + nTxSize >= nBlockMaxSize)
+        return false;
 
-                int nConf = nHeight - coins->nHeight;
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetJoinSplitValueIn();
+    if (!view.HaveInputs(tx))
+        return false;
 
-            if (fMissingInputs) continue;
+    CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+    nTxSigOps += GetP2SHSigOpCount(tx, view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    CValidationState state;
+    if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
+        return false;
+
+    UpdateCoins(tx, state, view, nHeight);
+
+    // Added
+    pblocktemplate->block.vtx.push_back(tx);
+    pblocktemplate->vTxFees.push_back(nTxFees);
+    pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    setInBlock.insert(tx.GetHash());
+
+    if (fPrintPriority)
+    {
+        LogPrintf("priority %.1f fee %s txid %s\n",
+            dPriority, CFeeRate(entry.GetModifiedFee(), nTxSize).ToString(), tx.GetHash().ToString());
+    }
+    return true;
+}
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+void CBlockAssembler::AddMempoolTransactions()
+{
+    CTxMemPool::setEntries failedTx;
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+    // Fill the first nBlockPrioritySize bytes with the highest priority
+    // transactions, from the priority each entry cached when it entered
+    // the pool
+    if (nBlockPrioritySize > 0)
+    {
+        vector<TxCoinAgePriority> vecPriority;
+        vecPriority.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
+             mi != mempool.mapTx.end(); ++mi)
+        {
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
+        TxCoinAgePriorityCompare comparer;
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
+        // Transactions waiting for one of their in-mempool parents
+        std::multimap<CTxMemPool::txiter, TxCoinAgePriority, CTxMemPool::CompareIteratorByHash> waitPriMap;
+
         while (!vecPriority.empty())
         {
             // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            double dPriority = vecPriority.front().first;
+            CTxMemPool::txiter iter = vecPriority.front().second;
 
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            bool fWaiting = false;
+            BOOST_FOREACH(const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(iter))
+            {
+                if (!setInBlock.count(parent->GetTx().GetHash())) {
+                    waitPriMap.insert(std::make_pair(parent, TxCoinAgePriority(dPriority, iter)));
+                    fWaiting = true;
+                    break;
+                }
+            }
+            if (fWaiting)
                 continue;
 
             // Prioritise by fee once past the priority size or we run out of high-priority
             // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+            if ((nBlockSize + iter->GetTxSize() >= nBlockPrioritySize) || !AllowFree(dPriority))
+                break;
+
+            if (AddToBlock(*iter, dPriority))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                // Queue the transactions that were waiting for this one
+                auto range = waitPriMap.equal_range(iter);
+                for (auto it = range.first; it != range.second; ++it)
+                {
+                    vecPriority.push_back(it->second);
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                }
+                waitPriMap.erase(range.first, range.second);
             }
+        }
+    }
 
-            if (!view.HaveInputs(tx))
+    // Then add the packages with the highest fee rates from the ancestor
+    // score index, each transaction with the ancestors it still needs
+    int nConsecutiveFailed = 0;
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
+    for (; mi != mempool.mapTx.get<ancestor_score>().end(); ++mi)
+    {
+        CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+        if (setInBlock.count(iter->GetTx().GetHash()) || failedTx.count(iter))
+            continue;
+
+        // Skip free transactions if we're past the minimum block size;
+        // the index is sorted by this fee rate, so the rest are free too
+        if (mi->GetModFeesWithAncestors() < ::minRelayTxFee.GetFee(mi->GetSizeWithAncestors()) &&
+            nBlockSize >= nBlockMinSize)
+            break;
+
+        CTxMemPool::setEntries setAncestors;
+        mempool.CalculateMemPoolAncestors(iter, setAncestors);
+        vector<CTxMemPool::txiter> vPackage;
+        uint64_t nPackageSize = iter->GetTxSize();
+        bool fFailedAncestor = false;
+        BOOST_FOREACH(const CTxMemPool::txiter& ancestor, setAncestors)
+        {
+            if (setInBlock.count(ancestor->GetTx().GetHash()))
                 continue;
+            if (failedTx.count(ancestor)) {
+                fFailedAncestor = true;
+                break;
+            }
+            vPackage.push_back(ancestor);
+            nPackageSize += ancestor->GetTxSize();
+        }
+        if (fFailedAncestor) {
+            failedTx.insert(iter);
+            continue;
+        }
+        vPackage.push_back(iter);
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+        if (nBlockSize + nPackageSize >= nBlockMaxSize)
+        {
+            if (++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockSize > nBlockMaxSize - 4000)
+                break;
+            continue;
+        }
+        nConsecutiveFailed = 0;
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+        std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount());
+        BOOST_FOREACH(const CTxMemPool::txiter& entry, vPackage)
+        {
+            if (!AddToBlock(*entry, entry->GetPriority(nHeight))) {
+                failedTx.insert(entry);
+                break;
+            }
+        }
+        if (setInBlock.count(iter->GetTx().GetHash()))
+            feeRateLowest = CFeeRate(mi->GetModFeesWithAncestors(), mi->GetSizeWithAncestors());
+    }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!ContextualCheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, Params().GetConsensus()))
-                continue;
+    nLastBlockTx = nBlockTx;
+    nLastBlockSize = nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+}
+
+void CBlockAssembler::UpdateCoinbase()
+{
+    CMutableTransaction txCoinbase(pblocktemplate->block.vtx[0]);
+    txCoinbase.vout[0].nValue = GetBlockSubsidy(nHeight, Params().GetConsensus()) + nFees;
+    pblocktemplate->block.vtx[0] = txCoinbase;
+    pblocktemplate->vTxFees[0] = -nFees;
+}
 
-            UpdateCoins(tx, state, view, nHeight);
+void CBlockAssembler::FinishBlock(const CScript& scriptPubKeyIn)
+{
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    // Create coinbase tx
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = GetBlockSubsidy(nHeight, Params().GetConsensus());
+
+    // Add fees
+    txNew.vout[0].nValue += nFees;
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -nFees;
+
+    // Randomise nonce
+    arith_uint256 nonce = UintToArith256(GetRandHash());
+    // Clear the top and bottom 16 bits (for local use as thread flags and counters)
+    nonce <<= 32;
+    nonce >>= 16;
+    pblock->nNonce = ArithToUint256(nonce);
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->hashReserved   = uint256();
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
+    pblock->nSolution.clear();
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
+    CValidationState state;
+    if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+}
+
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+    CBlockAssembler assembler(chainActive.Tip());
+    assembler.AddMempoolTransactions();
+    assembler.FinishBlock(scriptPubKeyIn);
+    return assembler.pblocktemplate.release();
+}
+
+CBlockTemplateBuilder* pblocktemplatebuilder = NULL;
+
+CBlockTemplateBuilder::CBlockTemplateBuilder() : fRebuild(true), nLastBuild(0)
+{
+}
+
+CBlockTemplateBuilder::~CBlockTemplateBuilder()
+{
+}
+
+void CBlockTemplateBuilder::SyncTransaction(const CTransaction &tx, const CBlock *pblock)
+{
+    // Transactions in a block arrive with the new tip, which rebuilds the template
+    if (pblock != NULL)
+        return;
+    LOCK(cs);
+    if (fRebuild)
+        return;
+    if (vPending.size() >= MAX_PENDING_TEMPLATE_TXS) {
+        vPending.clear();
+        fRebuild = true;
+        return;
+    }
+    vPending.push_back(tx.GetHash());
+}
+
+void CBlockTemplateBuilder::UpdatedBlockTip(const CBlockIndex *pindex)
+{
+    LOCK(cs);
+    vPending.clear();
+    fRebuild = true;
+}
+
+CBlockTemplate* CBlockTemplateBuilder::GetBlockTemplate(const CScript& scriptPubKeyIn)
+{
+    AssertLockHeld(cs_main);
+    LOCK(mempool.cs);
+
+    std::vector<uint256> vAccepted;
+    bool fBuild;
+    {
+        LOCK(cs);
+        vAccepted.swap(vPending);
+        fBuild = fRebuild;
+        fRebuild = false;
+    }
+    fBuild = fBuild || !passembler || passembler->pindexPrev != chainActive.Tip() || scriptPubKey != scriptPubKeyIn;
+
+    if (!fBuild)
+    {
+        // A transaction of the template that left the mempool (a conflict
+        // or an expiry) may have taken the coins its children spend with it
+        const std::vector<CTransaction>& vtx = passembler->pblocktemplate->block.vtx;
+        for (size_t i = 1; i < vtx.size(); i++) {
+            if (!mempool.exists(vtx[i].GetHash())) {
+                fBuild = true;
+                break;
             }
+        }
+    }
+
+    if (!fBuild && !vAccepted.empty())
+    {
+        // Append what the mempool accepted since the last call; a
+        // transaction left out that pays better than the template's
+        // cheapest package is worth a rebuild, at most every few seconds
+        bool fBetterLeftOut = false;
+        size_t nAdded = 0;
+        BOOST_FOREACH(const uint256& hash, vAccepted)
+        {
+            if (passembler->setInBlock.count(hash))
+                continue;
+            CTxMemPool::txiter it = mempool.mapTx.find(hash);
+            if (it == mempool.mapTx.end())
+                continue;
+            CFeeRate feeRate(it->GetModFeesWithAncestors(), it->GetSizeWithAncestors());
+            if (feeRate < ::minRelayTxFee && passembler->nBlockSize >= passembler->nBlockMinSize)
+                continue;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            bool fParentsInBlock = true;
+            BOOST_FOREACH(const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(it))
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                if (!passembler->setInBlock.count(parent->GetTx().GetHash())) {
+                    fParentsInBlock = false;
+                    break;
                 }
             }
+            if (fParentsInBlock && passembler->AddToBlock(*it, it->GetPriority(passembler->nHeight)))
+                nAdded++;
+            else if (feeRate > passembler->feeRateLowest)
+                fBetterLeftOut = true;
+        }
+        if (nAdded > 0) {
+            passembler->UpdateCoinbase();
+            LogPrint("mempool", "GetBlockTemplate(): appended %u transactions, total size %u\n", nAdded, passembler->nBlockSize);
         }
+        if (fBetterLeftOut && GetTime() - nLastBuild > 5)
+            fBuild = true;
+    }
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-
-        // Create coinbase tx
-        CMutableTransaction txNew;
-        txNew.vin.resize(1);
-        txNew.vin[0].prevout.SetNull();
-        txNew.vout.resize(1);
-        txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-        txNew.vout[0].nValue = GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-
-        // Add fees
-        txNew.vout[0].nValue += nFees;
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
-
-        // Randomise nonce
-        arith_uint256 nonce = UintToArith256(GetRandHash());
-        // Clear the top and bottom 16 bits (for local use as thread flags and counters)
-        nonce <<= 32;
-        nonce >>= 16;
-        pblock->nNonce = ArithToUint256(nonce);
-
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->hashReserved   = uint256();
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
-        pblock->nSolution.clear();
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
-
-        CValidationState state;
-        if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
-            throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+    if (fBuild)
+    {
+        passembler.reset();
+        std::unique_ptr<CBlockAssembler> passemblerNew(new CBlockAssembler(chainActive.Tip()));
+        passemblerNew->AddMempoolTransactions();
+        passemblerNew->FinishBlock(scriptPubKeyIn);
+        passembler = std::move(passemblerNew);
+        scriptPubKey = scriptPubKeyIn;
+        nLastBuild = GetTime();
     }
 
-    return pblocktemplate.release();
+    return passembler->pblocktemplate.get();
 }
 
 #ifdef ENABLE_WALLET
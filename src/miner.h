@@ -8,12 +8,17 @@
 #define BITCOIN_MINER_H
 
 #include "primitives/block.h"
+#include "script/script.h"
+#include "sync.h"
+#include "validationinterface.h"
 
 #include <boost/optional.hpp>
+#include <memory>
 #include <stdint.h>
+#include <vector>
 
+class CBlockAssembler;
 class CBlockIndex;
-class CScript;
 #ifdef ENABLE_WALLET
 class CReserveKey;
 class CWallet;
@@ -27,6 +32,9 @@ struct CBlockTemplate
     std::vector<int64_t> vTxSigOps;
 };
 
+/** Pending transactions kept for the next template update before a rebuild is cheaper */
+static const unsigned int MAX_PENDING_TEMPLATE_TXS = 100000;
+
 /** Generate a new block, without valid proof-of-work */
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 #ifdef ENABLE_WALLET
@@ -37,6 +45,39 @@ boost::optional<CScript> GetMinerScriptPubKey();
 CBlockTemplate* CreateNewBlockWithKey();
 #endif
 
+/**
+ * Keeps the block template served by getblocktemplate up to date. The
+ * template is built from the whole mempool once per tip; transactions the
+ * mempool accepts afterwards are appended to it on the next request, and
+ * it is only rebuilt when the tip changes, one of its transactions leaves
+ * the mempool or a better paying transaction did not fit.
+ */
+class CBlockTemplateBuilder : public CValidationInterface
+{
+private:
+    CCriticalSection cs;
+    // Accepted by the mempool since the last request
+    std::vector<uint256> vPending;
+    bool fRebuild;
+
+    std::unique_ptr<CBlockAssembler> passembler;
+    CScript scriptPubKey;
+    int64_t nLastBuild;
+
+public:
+    CBlockTemplateBuilder();
+    virtual ~CBlockTemplateBuilder();
+
+    /** Bring the template up to date and return it. It stays owned by the builder until the next call; cs_main must be held. */
+    CBlockTemplate* GetBlockTemplate(const CScript& scriptPubKeyIn);
+
+protected:
+    void SyncTransaction(const CTransaction &tx, const CBlock *pblock);
+    void UpdatedBlockTip(const CBlockIndex *pindex);
+};
+
+extern CBlockTemplateBuilder* pblocktemplatebuilder;
+
 #ifdef ENABLE_MINING
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
@@ -13,6 +13,7 @@
 #include "addrman.h"
 #include "chainparams.h"
 #include "clientversion.h"
+#include "init.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
 #include "ui_interface.h"
@@ -24,6 +25,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
@@ -756,6 +761,46 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+/**
+ * Receive the data waiting on a node's socket, up to one buffer. Returns true
+ * if the buffer was filled, so more data may still be waiting. Requires
+ * cs_vRecvMsg.
+ */
+bool SocketRecvData(CNode *pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf) && pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
 static list<CNode*> vNodesDisconnected;
 
 class CNodeRef {
@@ -985,73 +1030,110 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
-void CConnman::ThreadSocketHandler()
+void CConnman::DisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+void CConnman::InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
         }
+        else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+void CConnman::ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    // No fallback to the select() loop below: USE_POLL lifts the FD_SETSIZE
+    // limit on connections, which select() can't handle
+    ThreadSocketHandlerEpoll();
+    return;
+#endif
+
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
 
         //
         // Find which sockets have data to receive
@@ -1169,39 +1251,7 @@ void CConnman::ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -1216,42 +1266,220 @@ void CConnman::ThreadSocketHandler()
                     SocketSendData(pnode);
             }
 
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            InactivityCheck(pnode);
+        }
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+
+
+#ifdef USE_EPOLL
+namespace {
+
+/** Maximum number of socket events handled per epoll_wait() call */
+const int MAX_EPOLL_EVENTS = 1024;
+
+/** An epoll instance, closed when the socket handler thread exits or is interrupted */
+struct CEpollHandle
+{
+    int fd;
+    CEpollHandle() : fd(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~CEpollHandle() { if (fd != -1) close(fd); }
+};
+
+}
+
+/**
+ * Socket handler loop for Linux. Each node's socket is registered once with
+ * an edge-triggered epoll instance, so an iteration only handles the sockets
+ * that became ready instead of building and scanning fd_sets of all nodes.
+ * As a readiness edge is reported only once, a node stays pending until its
+ * socket has been drained, or until its queued messages were written, even
+ * if its buffers or locks hold it back for a while. If epoll can't be set
+ * up, the node shuts down.
+ */
+void CConnman::ThreadSocketHandlerEpoll()
+{
+    CEpollHandle epoll;
+    if (epoll.fd == -1) {
+        LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        uiInterface.ThreadSafeMessageBox(_("Error: Failed to set up the network socket handler, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+        StartShutdown();
+        return;
+    }
+
+    // Listening sockets have no node, and stay level-triggered so that each
+    // iteration accepts one more connection while any are waiting
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, hListenSocket.socket, &event) == -1) {
+            LogPrintf("epoll_ctl failed for listening socket: %s\n", NetworkErrorString(errno));
+            uiInterface.ThreadSafeMessageBox(_("Error: Failed to set up the network socket handler, see debug.log for details"), "", CClientUIInterface::MSG_ERROR);
+            StartShutdown();
+            return;
+        }
+    }
+
+    unsigned int nPrevNodeCount = 0;
+    // Nodes whose socket may have more data to read, and nodes whose socket
+    // can take more data. Each holds a reference to the node.
+    std::set<CNode*> setRecvPending;
+    std::set<CNode*> setSendPending;
+    std::vector<struct epoll_event> vEvents(MAX_EPOLL_EVENTS);
+    int64_t nLastInactivityCheck = 0;
+    bool fMoreToRead = false;
+    while (true)
+    {
+        DisconnectNodes(nPrevNodeCount);
+
+        // Register the sockets of new nodes, for both directions
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+                if (pnode->fSocketRegistered || pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                struct epoll_event event = {};
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1) {
+                    LogPrintf("epoll_ctl failed for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
                     pnode->fDisconnect = true;
                 }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
+                pnode->fSocketRegistered = true;
+            }
+        }
+
+        // Don't wait while a socket may still have data to read
+        int nEvents = epoll_wait(epoll.fd, &vEvents[0], vEvents.size(), fMoreToRead ? 0 : 50);
+        boost::this_thread::interruption_point();
+        if (nEvents == -1) {
+            int nErr = errno;
+            if (nErr != EINTR) {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(nErr));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        // Nodes are only deleted by DisconnectNodes above, and closing a
+        // socket removes it from the epoll instance, so the events point to
+        // live nodes
+        bool fAccept = false;
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; i++) {
+                CNode* pnode = (CNode*)vEvents[i].data.ptr;
+                if (!pnode) {
+                    fAccept = true;
+                    continue;
                 }
-                else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
+                if ((vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && setRecvPending.insert(pnode).second)
+                    pnode->AddRef();
+                if ((vEvents[i].events & EPOLLOUT) && setSendPending.insert(pnode).second)
+                    pnode->AddRef();
+            }
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAccept) {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                AcceptConnection(hListenSocket);
+        }
+
+        //
+        // Send, to nodes whose socket can take more data. A socket that
+        // fills up again reports a new edge once it has drained.
+        //
+        std::vector<CNode*> vDone;
+        for (std::set<CNode*>::iterator it = setSendPending.begin(); it != setSendPending.end(); )
+        {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET) {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend) {
+                    it++;
+                    continue;
                 }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                if (!pnode->vSendMsg.empty())
+                    SocketSendData(pnode);
+            }
+            vDone.push_back(pnode);
+            setSendPending.erase(it++);
+        }
+
+        //
+        // Receive, from nodes whose socket has data waiting. As with
+        // select(), queued messages are written first and a full receive
+        // buffer is left for the message handler to work through.
+        //
+        fMoreToRead = false;
+        for (std::set<CNode*>::iterator it = setRecvPending.begin(); it != setRecvPending.end(); )
+        {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET) {
                 {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend && !pnode->vSendMsg.empty()) {
+                        it++;
+                        continue;
+                    }
+                }
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (!lockRecv || (
+                    !pnode->vRecvMsg.empty() && pnode->vRecvMsg.front().complete() &&
+                    pnode->GetTotalRecvSize() > ReceiveFloodSize())) {
+                    it++;
+                    continue;
+                }
+                if (SocketRecvData(pnode)) {
+                    fMoreToRead = true;
+                    it++;
+                    continue;
                 }
             }
+            vDone.push_back(pnode);
+            setRecvPending.erase(it++);
         }
-        {
-            LOCK(cs_vNodes);
+
+        //
+        // Inactivity checking, whose timeouts are in seconds
+        //
+        int64_t nTime = GetTime();
+        if (nTime != nLastInactivityCheck) {
+            nLastInactivityCheck = nTime;
+            vector<CNode*> vNodesCopy;
+            {
+                LOCK(cs_vNodes);
+                vNodesCopy = vNodes;
+                BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                    pnode->AddRef();
+            }
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                InactivityCheck(pnode);
+            vDone.insert(vDone.end(), vNodesCopy.begin(), vNodesCopy.end());
+        }
+
+        if (!vDone.empty()) {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vDone)
                 pnode->Release();
         }
     }
 }
-
+#endif
 
 void CConnman::ThreadDNSAddressSeed()
 {
@@ -2013,6 +2241,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nServices = 0;
     hSocket = hSocketIn;
     nRecvVersion = INIT_PROTO_VERSION;
+#ifdef USE_EPOLL
+    fSocketRegistered = false;
+#endif
     nLastSend = 0;
     nLastRecv = 0;
     nSendBytes = 0;
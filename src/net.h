@@ -97,7 +97,12 @@ private:
     void ThreadOpenConnections();
     void ThreadMessageHandler();
     void AcceptConnection(const ListenSocket& hListenSocket);
+    void DisconnectNodes(unsigned int& nPrevNodeCount);
+    void InactivityCheck(CNode* pnode);
     void ThreadSocketHandler();
+#ifdef USE_EPOLL
+    void ThreadSocketHandlerEpoll();
+#endif
     void ThreadDNSAddressSeed();
 };
 extern std::unique_ptr<CConnman> g_connman;
@@ -106,6 +111,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 bool StartNode(CConnman& connman, boost::thread_group& threadGroup, CScheduler& scheduler, std::string& strNodeError);
 bool StopNode(CConnman& connman);
 void SocketSendData(CNode *pnode);
+bool SocketRecvData(CNode *pnode);
 
 typedef int NodeId;
 
@@ -279,6 +285,10 @@ public:
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
     int nRecvVersion;
+#ifdef USE_EPOLL
+    // Only used by the socket handler thread
+    bool fSocketRegistered; // the socket was added to the epoll instance
+#endif
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -10,6 +10,9 @@
 #include "tinyformat.h"
 #include "utilstrencodings.h"
 #include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
 
 uint256 CBlockHeader::GetHash() const
 {
@@ -61,15 +64,21 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if (nSize % 2 == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
+        }
+        // The nodes of a level are contiguous, so each pair of them is one
+        // 64-byte input and the whole level is hashed in a single batch.
+        // An odd last node is hashed with itself.
+        int nPairs = nSize / 2;
+        vMerkleTree.resize(j + nSize + (nSize + 1) / 2);
+        SHA256D64(vMerkleTree[j+nSize].begin(), vMerkleTree[j].begin(), nPairs);
+        if (nSize % 2) {
+            unsigned char pair[64];
+            memcpy(pair, vMerkleTree[j+nSize-1].begin(), 32);
+            memcpy(pair + 32, vMerkleTree[j+nSize-1].begin(), 32);
+            SHA256D64(vMerkleTree[j+nSize+nPairs].begin(), pair, 1);
         }
         j += nSize;
     }
@@ -204,8 +204,8 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
-    CBlock block;
     CBlockIndex* pblockindex = NULL;
+    CDiskBlockPos blockPos;
     {
         LOCK(cs_main);
         if (mapBlockIndex.count(hash) == 0)
@@ -214,13 +214,20 @@ static bool rest_block(HTTPRequest* req,
         pblockindex = mapBlockIndex[hash];
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+        blockPos = pblockindex->GetBlockPos();
+    }
 
-        if (!ReadBlockFromDisk(block, pblockindex))
+    // A recently connected block is taken from memory, any other block is
+    // read from disk without cs_main. The binary and hex formats are the
+    // bytes on disk.
+    std::shared_ptr<const CDataStream> pssRecent;
+    CDataStream ssRead(SER_NETWORK, PROTOCOL_VERSION);
+    if (rf == RF_BINARY || rf == RF_HEX) {
+        pssRecent = GetRecentBlockBytes(hash);
+        if (!pssRecent && !ReadRawBlockFromDisk(ssRead, blockPos, Params().MessageStart()))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
-
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
+    const CDataStream& ssBlock = pssRecent ? *pssRecent : ssRead;
 
     switch (rf) {
     case RF_BINARY: {
@@ -238,7 +245,16 @@ static bool rest_block(HTTPRequest* req,
     }
 
     case RF_JSON: {
-        UniValue objBlock = blockToJSON(block, pblockindex, showTxDetails);
+        std::shared_ptr<const CBlock> pblockRecent = GetRecentBlock(hash);
+        CBlock blockRead;
+        if (!pblockRecent && !ReadBlockFromDisk(blockRead, blockPos, hash))
+            return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
+        UniValue objBlock;
+        {
+            LOCK(cs_main);
+            objBlock = blockToJSON(block, pblockindex, showTxDetails);
+        }
         string strJSON = objBlock.write() + "\n";
         req->WriteHeader("Content-Type", "application/json");
         req->WriteReply(HTTP_OK, strJSON);
@@ -337,10 +337,9 @@ UniValue mempoolToJSON(bool fVerbose = false)
     {
         LOCK(mempool.cs);
         UniValue o(UniValue::VOBJ);
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             UniValue info(UniValue::VOBJ);
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -348,6 +347,12 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -402,6 +407,12 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see prioritisetransaction) of in-mempool ancestors (including this one)\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see prioritisetransaction) of in-mempool descendants (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -444,6 +455,86 @@ UniValue getblockdeltas(const UniValue& params, bool fHelp)
     return blockToDeltasJSON(block, pblockindex);
 }
 
+/** Default limit on the serialized size of the blocks returned by one getblockdeltasrange call */
+static const int64_t DEFAULT_BLOCK_DELTAS_MAX_BYTES = 16 << 20;
+/** Number of blocks getblockdeltasrange keeps read-ahead of the one it serializes */
+static const size_t BLOCK_DELTAS_PREFETCH_BLOCKS = 64;
+
+UniValue getblockdeltasrange(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 2 || params.size() > 3)
+        throw runtime_error(
+            "getblockdeltasrange start end ( maxbytes )\n"
+            "\nReturns the getblockdeltas results of the main chain blocks from height start to end,\n"
+            "stopping early once the blocks returned add up to maxbytes (requires spentindex to be enabled).\n"
+            "\nArguments:\n"
+            "1. start         (numeric, required) The height of the first block\n"
+            "2. end           (numeric, required) The height of the last block\n"
+            "3. maxbytes      (numeric, optional, default=" + strprintf("%d", DEFAULT_BLOCK_DELTAS_MAX_BYTES) + ") Stop after the blocks returned\n"
+            "                 reach this serialized size. At least one block is always returned.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blocks\": [     (array) The getblockdeltas result of each block, in height order\n"
+            "    ...\n"
+            "  ],\n"
+            "  \"next\": n       (numeric) The height to continue from, if the range was not completed\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockdeltasrange", "1000 2000")
+            + HelpExampleRpc("getblockdeltasrange", "1000, 2000")
+            );
+
+    int nStart = params[0].get_int();
+    int nEnd = params[1].get_int();
+    int64_t nMaxBytes = DEFAULT_BLOCK_DELTAS_MAX_BYTES;
+    if (params.size() > 2)
+        nMaxBytes = params[2].get_int64();
+    if (nMaxBytes <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "maxbytes must be positive");
+
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        if (nStart < 0 || nEnd < nStart || nEnd > chainActive.Height())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+        for (int nHeight = nStart; nHeight <= nEnd; nHeight++) {
+            const CBlockIndex* pblockindex = chainActive[nHeight];
+            if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+            vBlocks.push_back(pblockindex);
+        }
+    }
+
+    // Blocks are read without holding cs_main, while the OS reads the
+    // following ones in the background; cs_main is only taken to build
+    // each block's result.
+    UniValue blocks(UniValue::VARR);
+    int64_t nBytes = 0;
+    size_t nPrefetched = 0;
+    size_t i = 0;
+    for (; i < vBlocks.size() && nBytes < nMaxBytes; i++) {
+        if (nPrefetched < std::min(i + BLOCK_DELTAS_PREFETCH_BLOCKS / 2, vBlocks.size())) {
+            size_t nPrefetchEnd = std::min(i + BLOCK_DELTAS_PREFETCH_BLOCKS, vBlocks.size());
+            PrefetchBlocksFromDisk(std::vector<const CBlockIndex*>(vBlocks.begin() + nPrefetched, vBlocks.begin() + nPrefetchEnd));
+            nPrefetched = nPrefetchEnd;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, vBlocks[i]))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        nBytes += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+        LOCK(cs_main);
+        blocks.push_back(blockToDeltasJSON(block, vBlocks[i]));
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("blocks", blocks));
+    if (i < vBlocks.size())
+        result.push_back(Pair("next", nStart + (int)i));
+    return result;
+}
+
 UniValue getblockhashes(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2)
@@ -635,58 +726,73 @@ UniValue getblock(const UniValue& params, bool fHelp)
             + HelpExampleRpc("getblock", "12800")
         );
 
-    LOCK(cs_main);
-
     std::string strHash = params[0].get_str();
 
-    // If height is supplied, find the hash
-    if (strHash.size() < (2 * sizeof(uint256))) {
-        // std::stoi allows characters, whereas we want to be strict
-        regex r("[[:digit:]]+");
-        if (!regex_match(strHash, r)) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height parameter");
-        }
+    bool fVerbose = true;
+    if (params.size() > 1)
+        fVerbose = params[1].get_bool();
 
-        int nHeight = -1;
-        try {
-            nHeight = std::stoi(strHash);
-        }
-        catch (const std::exception &e) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height parameter");
-        }
+    CBlockIndex* pblockindex;
+    CDiskBlockPos blockPos;
+    {
+        LOCK(cs_main);
 
-        if (nHeight < 0 || nHeight > chainActive.Height()) {
-            throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
-        }
-        strHash = chainActive[nHeight]->GetBlockHash().GetHex();
-    }
+        // If height is supplied, find the hash
+        if (strHash.size() < (2 * sizeof(uint256))) {
+            // std::stoi allows characters, whereas we want to be strict
+            regex r("[[:digit:]]+");
+            if (!regex_match(strHash, r)) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height parameter");
+            }
 
-    uint256 hash(uint256S(strHash));
+            int nHeight = -1;
+            try {
+                nHeight = std::stoi(strHash);
+            }
+            catch (const std::exception &e) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid block height parameter");
+            }
 
-    bool fVerbose = true;
-    if (params.size() > 1)
-        fVerbose = params[1].get_bool();
+            if (nHeight < 0 || nHeight > chainActive.Height()) {
+                throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+            }
+            strHash = chainActive[nHeight]->GetBlockHash().GetHex();
+        }
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        uint256 hash(uint256S(strHash));
 
-    CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+        pblockindex = mapBlockIndex[hash];
 
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
+        blockPos = pblockindex->GetBlockPos();
+    }
 
+    // A recently connected block is taken from memory, any other block is
+    // read from disk without cs_main
+    uint256 hash = pblockindex->GetBlockHash();
     if (!fVerbose)
     {
-        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-        ssBlock << block;
+        std::shared_ptr<const CDataStream> pssRecent = GetRecentBlockBytes(hash);
+        CDataStream ssRead(SER_NETWORK, PROTOCOL_VERSION);
+        if (!pssRecent && !ReadRawBlockFromDisk(ssRead, blockPos, Params().MessageStart()))
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        const CDataStream& ssBlock = pssRecent ? *pssRecent : ssRead;
         std::string strHex = HexStr(ssBlock.begin(), ssBlock.end());
         return strHex;
     }
 
+    std::shared_ptr<const CBlock> pblockRecent = GetRecentBlock(hash);
+    CBlock blockRead;
+    if (!pblockRecent && !ReadBlockFromDisk(blockRead, blockPos, hash))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    const CBlock& block = pblockRecent ? *pblockRecent : blockRead;
+
+    LOCK(cs_main);
     return blockToJSON(block, pblockindex);
 }
 
@@ -894,7 +1000,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "        },\n"
             "        \"reject\": { ... }      (object) progress toward rejecting pre-softfork blocks (same fields as \"enforce\")\n"
             "     }, ...\n"
-            "  ]\n"
+            "  ],\n"
+            "  \"indexbuild\": {          (object, only while indexes are built in the background)\n"
+            "     \"indexes\": [ ... ],   (array of strings) the indexes being built\n"
+            "     \"height\": xxxxxx,     (numeric) the height they have been built up to\n"
+            "     \"progress\": xxxx      (numeric) estimate of build progress [0..1]\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -937,6 +1048,25 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    unsigned int nIndexes;
+    int nIndexHeight;
+    if (GetIndexBuildProgress(nIndexes, nIndexHeight))
+    {
+        UniValue indexes(UniValue::VARR);
+        if (nIndexes & INDEX_BUILD_ADDRESS)
+            indexes.push_back("addressindex");
+        if (nIndexes & INDEX_BUILD_SPENT)
+            indexes.push_back("spentindex");
+        if (nIndexes & INDEX_BUILD_TIMESTAMP)
+            indexes.push_back("timestampindex");
+
+        UniValue indexbuild(UniValue::VOBJ);
+        indexbuild.push_back(Pair("indexes",    indexes));
+        indexbuild.push_back(Pair("height",     nIndexHeight));
+        indexbuild.push_back(Pair("progress",   chainActive.Height() > 0 ? (double)nIndexHeight / chainActive.Height() : 1.0));
+        obj.push_back(Pair("indexbuild",        indexbuild));
+    }
     return obj;
 }
 
@@ -1051,6 +1181,9 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -1066,6 +1199,8 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
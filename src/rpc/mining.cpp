@@ -614,38 +614,19 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     }
 
     // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the pindexBest used before CreateNewBlockWithKey, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
 #ifdef ENABLE_WALLET
-        CReserveKey reservekey(pwalletMain);
-        pblocktemplate = CreateNewBlockWithKey(reservekey);
+    CReserveKey reservekey(pwalletMain);
+    boost::optional<CScript> scriptPubKey = GetMinerScriptPubKey(reservekey);
 #else
-        pblocktemplate = CreateNewBlockWithKey();
+    boost::optional<CScript> scriptPubKey = GetMinerScriptPubKey();
 #endif
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    if (!scriptPubKey)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Wallet keypool empty");
 
-        // Need to update only after we know CreateNewBlockWithKey succeeded
-        pindexPrev = pindexPrevNew;
-    }
+    // Store the transaction counter before the template is updated, to avoid races
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CBlockTemplate* pblocktemplate = pblocktemplatebuilder->GetBlockTemplate(*scriptPubKey);
+    CBlockIndex* pindexPrev = chainActive.Tip();
     CBlock* pblock = &pblocktemplate->block; // pointer for convenience
 
     // Update nTime
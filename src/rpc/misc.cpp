@@ -465,23 +465,46 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 
 bool getAddressFromIndex(const int &type, const uint160 &hash, std::string &address)
 {
-    if (type == 2) {
+    if (type == ADDRESSINDEX_SCRIPTHASH) {
         address = CBitcoinAddress(CScriptID(hash)).ToString();
-    } else if (type == 1) {
+    } else if (type == ADDRESSINDEX_PUBKEYHASH) {
         address = CBitcoinAddress(CKeyID(hash)).ToString();
+    } else if (type == ADDRESSINDEX_SCRIPT) {
+        address = hash.GetHex();
+    } else if (type == ADDRESSINDEX_SPROUT) {
+        address = "sprout";
     } else {
         return false;
     }
     return true;
 }
 
+bool getIndexKeyFromString(const std::string &str, uint160 &hashBytes, int &type)
+{
+    CBitcoinAddress address(str);
+    if (address.GetIndexKey(hashBytes, type))
+        return true;
+
+    if (str == "sprout") {
+        hashBytes.SetNull();
+        type = ADDRESSINDEX_SPROUT;
+        return true;
+    }
+
+    // any other scriptPubKey, given in hex
+    if (!str.empty() && IsHex(str)) {
+        std::vector<unsigned char> data(ParseHex(str));
+        return GetScriptAddressIndex(CScript(data.begin(), data.end()), type, hashBytes);
+    }
+    return false;
+}
+
 bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint160, int> > &addresses)
 {
     if (params[0].isStr()) {
-        CBitcoinAddress address(params[0].get_str());
         uint160 hashBytes;
         int type = 0;
-        if (!address.GetIndexKey(hashBytes, type)) {
+        if (!getIndexKeyFromString(params[0].get_str(), hashBytes, type)) {
             throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
         }
         addresses.push_back(std::make_pair(hashBytes, type));
@@ -496,10 +519,9 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
 
         for (std::vector<UniValue>::iterator it = values.begin(); it != values.end(); ++it) {
 
-            CBitcoinAddress address(it->get_str());
             uint160 hashBytes;
             int type = 0;
-            if (!address.GetIndexKey(hashBytes, type)) {
+            if (!getIndexKeyFromString(it->get_str(), hashBytes, type)) {
                 throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
             }
             addresses.push_back(std::make_pair(hashBytes, type));
@@ -511,6 +533,57 @@ bool getAddressesFromParams(const UniValue& params, std::vector<std::pair<uint16
     return true;
 }
 
+bool getAddressIndexPaging(const UniValue& params, size_t &limit, bool &fCursor, CAddressIndexKey &cursor)
+{
+    limit = 0;
+    fCursor = false;
+    if (!params[0].isObject()) {
+        return false;
+    }
+
+    UniValue limitValue = find_value(params[0].get_obj(), "limit");
+    if (limitValue.isNull()) {
+        return false;
+    }
+    if (!limitValue.isNum() || limitValue.get_int() <= 0) {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Limit is expected to be greater than zero");
+    }
+    limit = limitValue.get_int();
+
+    UniValue cursorValue = find_value(params[0].get_obj(), "cursor");
+    if (!cursorValue.isNull()) {
+        if (!cursorValue.isStr() || !IsHex(cursorValue.get_str())) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        std::vector<unsigned char> data(ParseHex(cursorValue.get_str()));
+        CDataStream ssCursor(data, SER_DISK, CLIENT_VERSION);
+        try {
+            ssCursor >> cursor;
+        } catch (const std::exception&) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+        }
+        fCursor = true;
+    }
+
+    return true;
+}
+
+UniValue getAddressIndexCursor(const CAddressIndexKey &key)
+{
+    CDataStream ssCursor(SER_DISK, CLIENT_VERSION);
+    ssCursor << key;
+    return HexStr(ssCursor.begin(), ssCursor.end());
+}
+
+bool addressIndexSort(std::pair<uint160, int> a,
+                      std::pair<uint160, int> b) {
+    // Same order as the address index keys: by type, then by hash
+    if (a.second == b.second) {
+        return a.first < b.first;
+    }
+    return a.second < b.second;
+}
+
 bool heightSort(std::pair<CAddressUnspentKey, CAddressUnspentValue> a,
                 std::pair<CAddressUnspentKey, CAddressUnspentValue> b) {
     return a.second.blockHeight < b.second.blockHeight;
@@ -531,7 +604,7 @@ UniValue getaddressmempool(const UniValue& params, bool fHelp)
             "{\n"
             "  \"addresses\"\n"
             "    [\n"
-            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"address\"  (string) The base58check encoded address, a hex scriptPubKey, or \"sprout\" for shielded pool flows\n"
             "      ,...\n"
             "    ]\n"
             "}\n"
@@ -582,7 +655,7 @@ UniValue getaddressmempool(const UniValue& params, bool fHelp)
         delta.push_back(Pair("index", (int)it->first.index));
         delta.push_back(Pair("satoshis", it->second.amount));
         delta.push_back(Pair("timestamp", it->second.time));
-        if (it->second.amount < 0) {
+        if (it->second.amount < 0 && it->first.type != ADDRESSINDEX_SPROUT) {
             delta.push_back(Pair("prevtxid", it->second.prevhash.GetHex()));
             delta.push_back(Pair("prevout", (int)it->second.prevout));
         }
@@ -602,7 +675,7 @@ UniValue getaddressutxos(const UniValue& params, bool fHelp)
             "{\n"
             "  \"addresses\"\n"
             "    [\n"
-            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"address\"  (string) The base58check encoded address, a hex scriptPubKey, or \"sprout\" for shielded pool flows\n"
             "      ,...\n"
             "    ],\n"
             "  \"chainInfo\"  (boolean) Include chain info with results\n"
@@ -688,12 +761,14 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "{\n"
             "  \"addresses\"\n"
             "    [\n"
-            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"address\"  (string) The base58check encoded address, a hex scriptPubKey, or \"sprout\" for shielded pool flows\n"
             "      ,...\n"
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
             "  \"chainInfo\" (boolean) Include chain info in results, only applies if start and end specified\n"
+            "  \"limit\" (number, optional) Return at most this many deltas, ordered by address and then height\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous call, to get the next deltas\n"
             "}\n"
             "\nResult:\n"
             "[\n"
@@ -705,8 +780,14 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
             "    \"address\"  (string) The base58check encoded address\n"
             "  }\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"deltas\"  (array) The deltas, as above\n"
+            "  \"cursor\"  (string) Pass this to get the next deltas, null when there are no more\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleCli("getaddressdeltas", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddressdeltas", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
 
@@ -740,17 +821,46 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
+    size_t limit = 0;
+    bool fCursor = false;
+    CAddressIndexKey cursor;
+    bool fPaging = getAddressIndexPaging(params, limit, fCursor, cursor);
+    bool fMore = false;
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (start > 0 && end > 0) {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
-                throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+    if (fPaging) {
+        std::sort(addresses.begin(), addresses.end(), addressIndexSort);
+        addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            const std::pair<uint160, int> cursorAddress(cursor.hashBytes, cursor.type);
+            if (fCursor && addressIndexSort(*it, cursorAddress)) {
+                continue;
             }
-        } else {
-            if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+            const CAddressIndexKey *pkeyAfter = (fCursor && *it == cursorAddress) ? &cursor : NULL;
+
+            // Ask for one more delta than needed to know whether there is another page
+            if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end, pkeyAfter, limit - addressIndex.size() + 1)) {
                 throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
             }
+            if (addressIndex.size() > limit) {
+                addressIndex.pop_back();
+                fMore = true;
+                break;
+            }
+        }
+    } else {
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+            if (start > 0 && end > 0) {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            } else {
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+            }
         }
     }
 
@@ -796,11 +906,17 @@ UniValue getaddressdeltas(const UniValue& params, bool fHelp)
         result.push_back(Pair("deltas", deltas));
         result.push_back(Pair("start", startInfo));
         result.push_back(Pair("end", endInfo));
-
-        return result;
+    } else if (fPaging) {
+        result.push_back(Pair("deltas", deltas));
     } else {
         return deltas;
     }
+
+    if (fPaging) {
+        result.push_back(Pair("cursor", fMore ? getAddressIndexCursor(addressIndex.back().first) : NullUniValue));
+    }
+
+    return result;
 }
 
 UniValue getaddressbalance(const UniValue& params, bool fHelp)
@@ -813,7 +929,7 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
             "{\n"
             "  \"addresses\"\n"
             "    [\n"
-            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"address\"  (string) The base58check encoded address, a hex scriptPubKey, or \"sprout\" for shielded pool flows\n"
             "      ,...\n"
             "    ]\n"
             "}\n"
@@ -833,22 +949,17 @@ UniValue getaddressbalance(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address");
     }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-
-    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        if (!GetAddressIndex((*it).first, (*it).second, addressIndex)) {
-            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
-        }
-    }
-
     CAmount balance = 0;
     CAmount received = 0;
 
-    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++) {
-        if (it->second > 0) {
-            received += it->second;
+    for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
+        CAmount addressBalance = 0;
+        CAmount addressReceived = 0;
+        if (!GetAddressBalance((*it).first, (*it).second, addressBalance, addressReceived)) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
         }
-        balance += it->second;
+        balance += addressBalance;
+        received += addressReceived;
     }
 
     UniValue result(UniValue::VOBJ);
@@ -869,19 +980,27 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
             "{\n"
             "  \"addresses\"\n"
             "    [\n"
-            "      \"address\"  (string) The base58check encoded address\n"
+            "      \"address\"  (string) The base58check encoded address, a hex scriptPubKey, or \"sprout\" for shielded pool flows\n"
             "      ,...\n"
             "    ]\n"
             "  \"start\" (number) The start block height\n"
             "  \"end\" (number) The end block height\n"
+            "  \"limit\" (number, optional) Return at most this many txids, ordered by address and then height\n"
+            "  \"cursor\" (string, optional) The cursor returned by the previous call, to get the next txids\n"
             "}\n"
             "\nResult:\n"
             "[\n"
             "  \"transactionid\"  (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult (with limit):\n"
+            "{\n"
+            "  \"txids\"  (array) The transaction ids, as above\n"
+            "  \"cursor\"  (string) Pass this to get the next txids, null when there are no more\n"
+            "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}'")
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"], \"limit\": 1000}'")
             + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"12c6DSiU4Rq3P4ZxziKxzrL5LmMBrzjrJX\"]}")
         );
 
@@ -902,6 +1021,62 @@ UniValue getaddresstxids(const UniValue& params, bool fHelp)
         }
     }
 
+    size_t limit = 0;
+    bool fCursor = false;
+    CAddressIndexKey cursor;
+    if (getAddressIndexPaging(params, limit, fCursor, cursor)) {
+        std::sort(addresses.begin(), addresses.end(), addressIndexSort);
+        addresses.erase(std::unique(addresses.begin(), addresses.end()), addresses.end());
+
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        UniValue txids(UniValue::VARR);
+        CAddressIndexKey lastKey;
+        bool fMore = false;
+
+        for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end() && !fMore; it++) {
+            const std::pair<uint160, int> cursorAddress(cursor.hashBytes, cursor.type);
+            if (fCursor && addressIndexSort(*it, cursorAddress)) {
+                continue;
+            }
+
+            // The deltas of one transaction are adjacent, so remembering the last
+            // txid is enough to skip duplicates, including across pages.
+            bool fAfter = fCursor && *it == cursorAddress;
+            CAddressIndexKey keyAfter = cursor;
+            uint256 lastTxid = fAfter ? cursor.txhash : uint256();
+
+            while (!fMore) {
+                addressIndex.clear();
+                if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end, fAfter ? &keyAfter : NULL, limit)) {
+                    throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available for address");
+                }
+
+                for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator ait=addressIndex.begin(); ait!=addressIndex.end(); ait++) {
+                    if (ait->first.txhash != lastTxid) {
+                        if (txids.size() == limit) {
+                            fMore = true;
+                            break;
+                        }
+                        txids.push_back(ait->first.txhash.GetHex());
+                        lastTxid = ait->first.txhash;
+                    }
+                    keyAfter = ait->first;
+                    fAfter = true;
+                    lastKey = ait->first;
+                }
+
+                if (addressIndex.size() < limit) {
+                    break;
+                }
+            }
+        }
+
+        UniValue result(UniValue::VOBJ);
+        result.push_back(Pair("txids", txids));
+        result.push_back(Pair("cursor", fMore ? getAddressIndexCursor(lastKey) : NullUniValue));
+        return result;
+    }
+
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
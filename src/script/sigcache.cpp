@@ -6,13 +6,14 @@
 
 #include "sigcache.h"
 
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <atomic>
 
 namespace {
 
@@ -20,56 +21,115 @@ namespace {
  * Valid signature cache, to avoid doing expensive ECDSA signature checking
  * twice for every transaction (once when accepted into memory pool, and
  * again when accepted into the block chain)
+ *
+ * Entries are salted 256-bit digests of (signature hash, signature, public
+ * key), kept in a fixed-size table of cache-line sized buckets of two
+ * entries each. Lookups and inserts only use relaxed atomic loads and stores
+ * of the digest words, so the script check threads never wait on each other.
+ * A lookup racing with an insert into the same slot can read a mix of two
+ * digests, which only matches a third digest with negligible probability,
+ * so a hit always means the signature was verified. An insert into a full
+ * bucket overwrites one of its entries picked by the (secret, salted)
+ * digest itself, which keeps the memory bounded and cannot be targeted by
+ * attackers.
  */
 class CSignatureCache
 {
 private:
-     //! sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    static const size_t WORDS_PER_ENTRY = 4;
+    static const size_t ENTRIES_PER_BUCKET = 2;
+    static const size_t WORDS_PER_BUCKET = WORDS_PER_ENTRY * ENTRIES_PER_BUCKET;
+    static const uint64_t MAX_BUCKETS = (uint64_t)1 << 20;
+
+    //! Hasher with the salt already written into its first block
+    CSHA256 saltedHasher;
+    //! Digest words, with the buckets starting at nFirstWord
+    std::vector<std::atomic<uint64_t> > vWords;
+    size_t nFirstWord;
+    //! Number of buckets minus one; the number of buckets is a power of two
+    uint64_t nBucketMask;
+
+    void ComputeEntry(uint64_t entry[WORDS_PER_ENTRY], const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+    {
+        unsigned char digest[CSHA256::OUTPUT_SIZE];
+        CSHA256(saltedHasher).Write(hash.begin(), hash.size()).Write(pubKey.begin(), pubKey.size()).Write(vchSig.data(), vchSig.size()).Finalize(digest);
+        for (size_t i = 0; i < WORDS_PER_ENTRY; i++)
+            entry[i] = ReadLE64(digest + 8 * i);
+    }
+
+    std::atomic<uint64_t>* GetBucket(const uint64_t entry[WORDS_PER_ENTRY])
+    {
+        return &vWords[nFirstWord + (entry[0] & nBucketMask) * WORDS_PER_BUCKET];
+    }
 
 public:
+    CSignatureCache() : nFirstWord(0), nBucketMask(0)
+    {
+        unsigned char salt[64] = {};
+        GetRandBytes(salt, 32);
+        saltedHasher.Write(salt, sizeof(salt));
+
+        // Since there can be no more than 20,000 signature operations per block
+        // 50,000 entries is a reasonable default, rounded up to 65,536 entries
+        // of 32 bytes each (2MB). The table is allocated up front, so cap it at
+        // MAX_BUCKETS (64MB) whatever -maxsigcachesize asks for.
+        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
+        if (nMaxCacheSize <= 0)
+            return;
+        uint64_t nBuckets = 1;
+        while (nBuckets * ENTRIES_PER_BUCKET < (uint64_t)nMaxCacheSize && nBuckets < MAX_BUCKETS)
+            nBuckets <<= 1;
+        nBucketMask = nBuckets - 1;
+
+        // Zero words mark empty entries. Align the buckets to cache lines so
+        // threads touching different buckets never share one.
+        std::vector<std::atomic<uint64_t> > vWordsIn(nBuckets * WORDS_PER_BUCKET + WORDS_PER_BUCKET - 1);
+        vWords.swap(vWordsIn);
+        while ((reinterpret_cast<uintptr_t>(&vWords[nFirstWord]) % (WORDS_PER_BUCKET * sizeof(uint64_t))) != 0)
+            nFirstWord++;
+    }
+
     bool
     Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+        if (vWords.empty())
+            return false;
+
+        uint64_t entry[WORDS_PER_ENTRY];
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        std::atomic<uint64_t>* bucket = GetBucket(entry);
+        for (size_t i = 0; i < ENTRIES_PER_BUCKET; i++) {
+            std::atomic<uint64_t>* slot = bucket + i * WORDS_PER_ENTRY;
+            size_t j = 0;
+            while (j < WORDS_PER_ENTRY && slot[j].load(std::memory_order_relaxed) == entry[j])
+                j++;
+            if (j == WORDS_PER_ENTRY)
+                return true;
+        }
         return false;
     }
 
     void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there can be no more than 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
-
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+        if (vWords.empty())
+            return;
+
+        uint64_t entry[WORDS_PER_ENTRY];
+        ComputeEntry(entry, hash, vchSig, pubKey);
+        std::atomic<uint64_t>* bucket = GetBucket(entry);
+
+        // Use an empty entry if there is one, otherwise evict one picked by
+        // a digest bit not used for the bucket index
+        size_t nVictim = (entry[1] >> 63) % ENTRIES_PER_BUCKET;
+        for (size_t i = 0; i < ENTRIES_PER_BUCKET; i++) {
+            if (bucket[i * WORDS_PER_ENTRY].load(std::memory_order_relaxed) == 0) {
+                nVictim = i;
+                break;
+            }
         }
-
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        std::atomic<uint64_t>* slot = bucket + nVictim * WORDS_PER_ENTRY;
+        for (size_t j = 0; j < WORDS_PER_ENTRY; j++)
+            slot[j].store(entry[j], std::memory_order_relaxed);
     }
 };
 
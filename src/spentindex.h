@@ -18,7 +18,7 @@ struct CSpentIndexKey {
     template <typename Stream, typename Operation>
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
         READWRITE(txid);
-        READWRITE(outputIndex);
+        READWRITE(VARINT(outputIndex));
     }
 
     CSpentIndexKey(uint256 t, unsigned int i) {
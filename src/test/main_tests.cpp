@@ -74,4 +74,39 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(read_mapped_block_file)
+{
+    // Use a block file of its own, away from the genesis block
+    const int nFile = 1000;
+    CBlock block1 = Params().GenesisBlock();
+    CBlock block2 = block1;
+    block2.nTime++;
+
+    CDiskBlockPos pos1(nFile, 0);
+    BOOST_CHECK(WriteBlockToDisk(block1, pos1, Params().MessageStart()));
+    CBlock block;
+    BOOST_CHECK(ReadBlockFromDisk(block, pos1, block1.GetHash()));
+    BOOST_CHECK(block.GetHash() == block1.GetHash());
+
+    // A block appended after the file was mapped is found by mapping it again
+    CDiskBlockPos pos2(nFile, pos1.nPos + ::GetSerializeSize(block1, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(WriteBlockToDisk(block2, pos2, Params().MessageStart()));
+    BOOST_CHECK(ReadBlockFromDisk(block, pos2, block2.GetHash()));
+    BOOST_CHECK(block.GetHash() == block2.GetHash());
+    BOOST_CHECK(ReadBlockFromDisk(block, pos1, block1.GetHash()));
+    BOOST_CHECK(block.GetHash() == block1.GetHash());
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    BOOST_CHECK(ReadRawBlockFromDisk(ssBlock, pos2, Params().MessageStart()));
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected << block2;
+    BOOST_CHECK(ssBlock.str() == ssExpected.str());
+
+    // Pruned files can't be read any more
+    std::set<int> setFilesToPrune;
+    setFilesToPrune.insert(nFile);
+    UnlinkPrunedFiles(setFilesToPrune);
+    BOOST_CHECK(!ReadBlockFromDisk(block, pos1, block1.GetHash()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
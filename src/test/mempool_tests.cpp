@@ -102,4 +102,201 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorTrackingTest)
+{
+    // Test the ancestor and descendant aggregates of CTxMemPoolEntry
+
+    // A chain txA -> txB -> txC, and txD spending an output of both txA and txB:
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 33000LL;
+    }
+    CMutableTransaction txB;
+    txB.vin.resize(1);
+    txB.vin[0].scriptSig = CScript() << OP_11;
+    txB.vin[0].prevout.hash = txA.GetHash();
+    txB.vin[0].prevout.n = 0;
+    txB.vout.resize(2);
+    for (int i = 0; i < 2; i++)
+    {
+        txB.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txB.vout[i].nValue = 11000LL;
+    }
+    CMutableTransaction txC;
+    txC.vin.resize(1);
+    txC.vin[0].scriptSig = CScript() << OP_11;
+    txC.vin[0].prevout.hash = txB.GetHash();
+    txC.vin[0].prevout.n = 0;
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txC.vout[0].nValue = 10000LL;
+    CMutableTransaction txD;
+    txD.vin.resize(2);
+    txD.vin[0].scriptSig = CScript() << OP_11;
+    txD.vin[0].prevout.hash = txA.GetHash();
+    txD.vin[0].prevout.n = 1;
+    txD.vin[1].scriptSig = CScript() << OP_11;
+    txD.vin[1].prevout.hash = txB.GetHash();
+    txD.vin[1].prevout.n = 1;
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txD.vout[0].nValue = 40000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    std::list<CTransaction> removed;
+
+    testPool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 100, 0, 0.0, 1));
+    testPool.addUnchecked(txB.GetHash(), CTxMemPoolEntry(txB, 200, 0, 0.0, 1));
+    testPool.addUnchecked(txC.GetHash(), CTxMemPoolEntry(txC, 300, 0, 0.0, 1));
+    testPool.addUnchecked(txD.GetHash(), CTxMemPoolEntry(txD, 4000, 0, 0.0, 1));
+    CTxMemPool::txiter itA = testPool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itB = testPool.mapTx.find(txB.GetHash());
+    CTxMemPool::txiter itC = testPool.mapTx.find(txC.GetHash());
+    CTxMemPool::txiter itD = testPool.mapTx.find(txD.GetHash());
+
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 4600);
+    BOOST_CHECK_EQUAL(itB->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itB->GetModFeesWithDescendants(), 4500);
+    BOOST_CHECK_EQUAL(itC->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itC->GetModFeesWithAncestors(), 600);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itD->GetSizeWithAncestors(), itA->GetTxSize() + itB->GetTxSize() + itD->GetTxSize());
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 4300);
+
+    // The package with the best ancestor fee rate comes first:
+    BOOST_CHECK(testPool.mapTx.get<ancestor_score>().begin()->GetTx().GetHash() == txD.GetHash());
+
+    // A fee delta reaches the ancestors and descendants of the entry:
+    testPool.PrioritiseTransaction(txB.GetHash(), txB.GetHash().ToString(), 0, 50);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 4650);
+    BOOST_CHECK_EQUAL(itC->GetModFeesWithAncestors(), 650);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 4350);
+
+    // Mine txA:
+    testPool.remove(txA, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    removed.clear();
+    BOOST_CHECK_EQUAL(itB->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itB->GetModFeesWithAncestors(), 250);
+    BOOST_CHECK_EQUAL(itB->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 4250);
+
+    // Disconnect the block again; txA is linked back to its in-mempool children:
+    testPool.addUnchecked(txA.GetHash(), CTxMemPoolEntry(txA, 100, 0, 0.0, 1));
+    itA = testPool.mapTx.find(txA.GetHash());
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 4650);
+    BOOST_CHECK_EQUAL(itC->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 3);
+
+    // Removing txB takes txC and txD with it:
+    testPool.remove(txB, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK_EQUAL(testPool.size(), 1);
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(itA->GetSizeWithDescendants(), itA->GetTxSize());
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 100);
+    removed.clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // Test CTxMemPool::TrimToSize and the rolling minimum fee
+
+    CTxMemPool pool(CFeeRate(1000));
+    std::list<CTransaction> removed;
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+
+    // Nothing to do at the current size
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    // The lower fee rate transaction goes first
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    // A child paying for its parent keeps the parent in
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000LL, 0, 0.0, 1));
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000LL, 0, 0.0, 1));
+
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    // Nothing fits in the size of one transaction
+    pool.TrimToSize(::GetSerializeSize(CTransaction(tx1), SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), CTxMemPool(CFeeRate(1000)).DynamicMemoryUsage());
+
+    // The minimum fee is the highest evicted package fee rate plus the relay fee
+    CFeeRate maxFeeRateRemoved(25000, ::GetSerializeSize(CTransaction(tx3), SER_NETWORK, PROTOCOL_VERSION) +
+                                      ::GetSerializeSize(CTransaction(tx2), SER_NETWORK, PROTOCOL_VERSION));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // It only decays once a block has been found, with a half-life of
+    // ROLLING_FEE_HALFLIFE while the pool is full
+    SetMockTime(42);
+    std::vector<CTransaction> vtx;
+    pool.removeForBlock(vtx, 1, removed, false);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), (maxFeeRateRemoved.GetFeePerK() + 1000) / 2);
+
+    // Below half the relay fee it drops to zero
+    SetMockTime(42 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+
+    // JoinSplits count towards the memory usage, and an evicted transaction
+    // releases its nullifiers
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000LL, 0, 0.0, 1));
+    size_t nUsageWithoutJoinSplit = pool.DynamicMemoryUsage();
+
+    CMutableTransaction txJS;
+    txJS.vjoinsplit.resize(1);
+    txJS.vjoinsplit[0].nullifiers[0] = GetRandHash();
+    txJS.vjoinsplit[0].nullifiers[1] = GetRandHash();
+    txJS.vjoinsplit[0].vpub_new = COIN;
+    pool.addUnchecked(txJS.GetHash(), CTxMemPoolEntry(txJS, 1000LL, 0, 0.0, 1));
+    BOOST_CHECK(pool.DynamicMemoryUsage() >= nUsageWithoutJoinSplit + sizeof(JSDescription));
+    BOOST_CHECK_EQUAL(pool.mapNullifiers.size(), 2);
+
+    pool.TrimToSize(nUsageWithoutJoinSplit);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(txJS.GetHash()));
+    BOOST_CHECK(pool.mapNullifiers.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
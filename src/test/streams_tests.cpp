@@ -64,4 +64,28 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
             std::string(ds.begin(), ds.end()));  
 }         
 
+BOOST_AUTO_TEST_CASE(streams_memory_reader)
+{
+    CDataStream ds(SER_DISK, 0);
+    ds << (uint32_t)0x01020304 << std::string("abc") << (uint8_t)5;
+    std::string data = ds.str();
+
+    CMemoryReader reader(&data[0], &data[0] + data.size(), SER_DISK, 0);
+    uint32_t n;
+    std::string str;
+    uint8_t c;
+    reader >> n >> str >> c;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK_EQUAL(str, "abc");
+    BOOST_CHECK_EQUAL(c, 5);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> c, std::ios_base::failure);
+
+    CMemoryReader skipping(&data[0], &data[0] + data.size(), SER_DISK, 0);
+    skipping.ignore(data.size() - 1);
+    skipping >> c;
+    BOOST_CHECK_EQUAL(c, 5);
+    BOOST_CHECK_THROW(skipping.ignore(1), std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
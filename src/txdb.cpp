@@ -24,11 +24,16 @@ static const char DB_NULLIFIER = 's';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
-static const char DB_ADDRESSINDEX = 'd';
-static const char DB_ADDRESSUNSPENTINDEX = 'u';
+static const char DB_ADDRESSINDEX = 'D';
+static const char DB_ADDRESSUNSPENTINDEX = 'U';
+static const char DB_ADDRESSBALANCEINDEX = 'v';
 static const char DB_TIMESTAMPINDEX = 'S';
 static const char DB_BLOCKHASHINDEX = 'z';
-static const char DB_SPENTINDEX = 'p';
+static const char DB_SPENTINDEX = 'P';
+// Keyspaces of the fixed-width index keys, moved to the compact ones by UpgradeIndexKeys()
+static const char DB_ADDRESSINDEX_V0 = 'd';
+static const char DB_ADDRESSUNSPENTINDEX_V0 = 'u';
+static const char DB_SPENTINDEX_V0 = 'p';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
@@ -36,7 +41,11 @@ static const char DB_BEST_ANCHOR = 'a';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_BEST_INDEXED_BLOCK = 'I';
+static const char DB_INDEX_BUILD_STATE = 'N';
 
+//! Bytes of index entries copied per batch when moving them out of the block tree
+static const size_t MAX_INDEX_MOVE_BATCH_SIZE = 16 << 20;
 
 void static BatchWriteAnchor(CLevelDBBatch &batch,
                              const uint256 &croot,
@@ -78,7 +87,6 @@ CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory,
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, false, 64) {
 }
 
-
 bool CCoinsViewDB::GetAnchorAt(const uint256 &rt, ZCIncrementalMerkleTree &tree) const {
     if (rt == ZCIncrementalMerkleTree::empty_root()) {
         ZCIncrementalMerkleTree new_tree;
@@ -166,7 +174,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, compression, maxOpenFiles) {
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, compression, maxOpenFiles), fHoldIndexBatch(false) {
 }
 
 bool CBlockTreeDB::ReadBlockFileInfo(int nFile, CBlockFileInfo &info) {
@@ -259,22 +267,188 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
 }
 
 bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
+    if (!WriteIndexBatch())
+        return false;
     return Read(make_pair(DB_TXINDEX, txid), pos);
 }
 
 bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
-    CLevelDBBatch batch;
+    LOCK(cs_indexBatch);
     for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
-    return WriteBatch(batch);
+        indexBatch.Write(make_pair(DB_TXINDEX, it->first), it->second);
+    return true;
+}
+
+bool CBlockTreeDB::WriteBestIndexedBlock(const uint256 &hash) {
+    LOCK(cs_indexBatch);
+    indexBatch.Write(DB_BEST_INDEXED_BLOCK, hash);
+    return true;
+}
+
+bool CBlockTreeDB::ReadBestIndexedBlock(uint256 &hash) {
+    if (!WriteIndexBatch())
+        return false;
+    return Read(DB_BEST_INDEXED_BLOCK, hash);
+}
+
+bool CBlockTreeDB::WriteIndexBatch(bool fSync) {
+    LOCK(cs_indexBatch);
+    if (fHoldIndexBatch)
+        return true;
+    if (indexBatch.SizeEstimate() == 0 && !fSync)
+        return true;
+    LogPrint("coindb", "Committing %u bytes of transaction index updates to block tree database...\n", (unsigned int)indexBatch.SizeEstimate());
+    if (!WriteBatch(indexBatch, fSync))
+        return false;
+    indexBatch.Clear();
+    return true;
+}
+
+size_t CBlockTreeDB::GetIndexBatchSize() {
+    LOCK(cs_indexBatch);
+    return indexBatch.SizeEstimate();
+}
+
+void CBlockTreeDB::HoldIndexBatch(bool fHold) {
+    LOCK(cs_indexBatch);
+    fHoldIndexBatch = fHold;
+}
+
+bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
+    return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
+}
+
+bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
+    char ch;
+    if (!Read(std::make_pair(DB_FLAG, name), ch))
+        return false;
+    fValue = ch == '1';
+    return true;
 }
 
-bool CBlockTreeDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_BLOCK_INDEX, uint256());
+    pcursor->Seek(ssKeySet.str());
+
+    // Load mapBlockIndex
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType == DB_BLOCK_INDEX) {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                CDiskBlockIndex diskindex;
+                ssValue >> diskindex;
+
+                // Construct block index object
+                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+                pindexNew->nHeight        = diskindex.nHeight;
+                pindexNew->nFile          = diskindex.nFile;
+                pindexNew->nDataPos       = diskindex.nDataPos;
+                pindexNew->nUndoPos       = diskindex.nUndoPos;
+                pindexNew->hashAnchor     = diskindex.hashAnchor;
+                pindexNew->nVersion       = diskindex.nVersion;
+                pindexNew->hashReserved   = diskindex.hashReserved;
+                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+                pindexNew->nTime          = diskindex.nTime;
+                pindexNew->nBits          = diskindex.nBits;
+                pindexNew->nNonce         = diskindex.nNonce;
+																   
+                pindexNew->nSolution      = diskindex.nSolution;
+                pindexNew->nStatus        = diskindex.nStatus;
+                pindexNew->nTx            = diskindex.nTx;
+                pindexNew->nSproutValue   = diskindex.nSproutValue;
+
+                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
+                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+
+                pcursor->Next();
+            } else {
+                break; // if shutdown requested or finished loading block index
+            }
+        } catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+
+    return true;
+}
+
+CIndexDB::CIndexDB(size_t nCacheSize, bool fMemory, bool fWipe, bool compression, int maxOpenFiles) : CLevelDBWrapper(GetDataDir() / "indexes", nCacheSize, fMemory, fWipe, compression, maxOpenFiles), fHoldIndexBatch(false) {
+}
+
+bool CIndexDB::MoveFromBlockTree(CBlockTreeDB &blocktree) {
+    // Keyspaces that used to be kept in the block tree database
+    const char chMoved[] = {DB_ADDRESSINDEX, DB_ADDRESSUNSPENTINDEX, DB_ADDRESSBALANCEINDEX, DB_SPENTINDEX,
+                            DB_ADDRESSINDEX_V0, DB_ADDRESSUNSPENTINDEX_V0, DB_SPENTINDEX_V0,
+                            DB_TIMESTAMPINDEX, DB_BLOCKHASHINDEX, DB_INDEX_BUILD_STATE};
+    const char* pszFlags[] = {"addressindex", "addressbalanceindex", "addressindexscripts", "spentindex", "timestampindex"};
+
+    // Entries are copied before they are erased from the block tree, so an
+    // interrupted move is simply resumed on the next start.
+    boost::scoped_ptr<leveldb::Iterator> pcursor(blocktree.NewIterator());
+    CLevelDBBatch batch, batchErase;
+    size_t nMoved = 0;
+    for (unsigned int i = 0; i < sizeof(chMoved); i++) {
+        pcursor->Seek(leveldb::Slice(&chMoved[i], 1));
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != chMoved[i])
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            batch.Write(CFlatData((char*)slKey.data(), (char*)slKey.data() + slKey.size()),
+                        CFlatData((char*)slValue.data(), (char*)slValue.data() + slValue.size()));
+            batchErase.Erase(CFlatData((char*)slKey.data(), (char*)slKey.data() + slKey.size()));
+            nMoved++;
+            if (batch.SizeEstimate() > MAX_INDEX_MOVE_BATCH_SIZE) {
+                if (!WriteBatch(batch, true) || !blocktree.WriteBatch(batchErase))
+                    return false;
+                batch.Clear();
+                batchErase.Clear();
+            }
+            pcursor->Next();
+        }
+    }
+
+    bool fFlags = false;
+    for (unsigned int i = 0; i < sizeof(pszFlags) / sizeof(pszFlags[0]); i++) {
+        bool fValue;
+        if (blocktree.ReadFlag(pszFlags[i], fValue)) {
+            batch.Write(std::make_pair(DB_FLAG, std::string(pszFlags[i])), fValue ? '1' : '0');
+            batchErase.Erase(std::make_pair(DB_FLAG, std::string(pszFlags[i])));
+            fFlags = true;
+        }
+    }
+
+    // The block tree keeps its marker, which also covers the transaction index
+    uint256 hashBestIndexed;
+    if ((nMoved > 0 || fFlags) && !Exists(DB_BEST_INDEXED_BLOCK) && blocktree.ReadBestIndexedBlock(hashBestIndexed))
+        batch.Write(DB_BEST_INDEXED_BLOCK, hashBestIndexed);
+
+    if (nMoved > 0 || fFlags)
+        LogPrintf("%s: moved %u index entries to the index database\n", __func__, nMoved);
+    return WriteBatch(batch, true) && blocktree.WriteBatch(batchErase, true);
+}
+
+bool CIndexDB::ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value) {
+    if (!WriteIndexBatch())
+        return false;
     return Read(make_pair(DB_SPENTINDEX, key), value);
 }
 
-bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
-    CLevelDBBatch batch;
+bool CIndexDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect) {
+    LOCK(cs_indexBatch);
+    CLevelDBBatch &batch = indexBatch;
     for (std::vector<std::pair<CSpentIndexKey,CSpentIndexValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_SPENTINDEX, it->first));
@@ -282,11 +456,22 @@ bool CBlockTreeDB::UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey,
             batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return true;
 }
 
-bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
+bool CIndexDB::WriteIndexEntries(const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                                     const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &spentIndex) {
     CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=addressIndex.begin(); it!=addressIndex.end(); it++)
+        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    for (std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >::const_iterator it=spentIndex.begin(); it!=spentIndex.end(); it++)
+        batch.Write(make_pair(DB_SPENTINDEX, it->first), it->second);
+    return WriteBatch(batch);
+}
+
+bool CIndexDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect) {
+    LOCK(cs_indexBatch);
+    CLevelDBBatch &batch = indexBatch;
     for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
         if (it->second.IsNull()) {
             batch.Erase(make_pair(DB_ADDRESSUNSPENTINDEX, it->first));
@@ -294,12 +479,20 @@ bool CBlockTreeDB::UpdateAddressUnspentIndex(const std::vector<std::pair<CAddres
             batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, it->first), it->second);
         }
     }
-    return WriteBatch(batch);
+    return true;
 }
 
-bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
+bool CIndexDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
                                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &unspentOutputs) {
 
+    if (!WriteIndexBatch())
+        return false;
+
+    // An address without a balance entry has no history. That lookup is
+    // answered by the bloom filters without reading any index blocks.
+    if (!Exists(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash))))
+        return true;
+
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
@@ -337,36 +530,105 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CLevelDBBatch batch;
+void CIndexDB::BatchUpdateAddressBalance(CLevelDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect, bool fUndo) {
+    AssertLockHeld(cs_indexBatch);
+
+    // Sum up the deltas per address first, so every balance is read and written once
+    std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue> mapDeltas;
+    for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++) {
+        CAddressBalanceValue &delta = mapDeltas[make_pair(it->first.type, it->first.hashBytes)];
+        delta.balance += it->second;
+        if (it->second > 0)
+            delta.received += it->second;
+        delta.blockHeight = std::max(delta.blockHeight, it->first.blockHeight);
+    }
+
+    for (std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue>::const_iterator it=mapDeltas.begin(); it!=mapDeltas.end(); it++) {
+        const CAddressIndexIteratorKey key(it->first.first, it->first.second);
+        const CAddressBalanceValue &delta = it->second;
+        CAddressBalanceValue value;
+        std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue>::const_iterator mi = mapBatchBalances.find(it->first);
+        if (mi != mapBatchBalances.end()) {
+            value = mi->second;
+        } else {
+            Read(make_pair(DB_ADDRESSBALANCEINDEX, key), value);
+        }
+
+        // The balance records the last block height it includes, so that a block
+        // connected or disconnected again after an unclean shutdown is not counted twice.
+        if (!fUndo) {
+            if (!value.IsNull() && value.blockHeight >= delta.blockHeight)
+                continue;
+            value.balance += delta.balance;
+            value.received += delta.received;
+            value.blockHeight = delta.blockHeight;
+        } else {
+            if (value.IsNull() || value.blockHeight < delta.blockHeight)
+                continue;
+            value.balance -= delta.balance;
+            value.received -= delta.received;
+            value.blockHeight = delta.blockHeight - 1;
+        }
+
+        // Entries are kept even when they drop back to zero, since address
+        // lookups use them to tell whether an address has any history.
+        batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, key), value);
+        mapBatchBalances[it->first] = value;
+    }
+}
+
+bool CIndexDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+    LOCK(cs_indexBatch);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
-    return WriteBatch(batch);
+        indexBatch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    BatchUpdateAddressBalance(indexBatch, vect, false);
+    return true;
 }
 
-bool CBlockTreeDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
-    CLevelDBBatch batch;
+bool CIndexDB::EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >&vect) {
+    LOCK(cs_indexBatch);
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
-    return WriteBatch(batch);
+        indexBatch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+    BatchUpdateAddressBalance(indexBatch, vect, true);
+    return true;
 }
 
-bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
+bool CIndexDB::ReadAddressIndex(uint160 addressHash, int type,
                                     std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                                    int start, int end) {
+                                    int start, int end,
+                                    const CAddressIndexKey *pkeyAfter, size_t nLimit) {
+
+    if (!WriteIndexBatch())
+        return false;
+
+    // See ReadAddressUnspentIndex()
+    if (!Exists(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash))))
+        return true;
 
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    if (start > 0 && end > 0) {
-        ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start));
+    if (pkeyAfter && (start <= 0 || end <= 0 || pkeyAfter->blockHeight >= start)) {
+        // Resume right after the last key returned by a previous call
+        ssKeySet << make_pair(DB_ADDRESSINDEX, *pkeyAfter);
+        pcursor->Seek(ssKeySet.str());
+        if (pcursor->Valid() && pcursor->key() == leveldb::Slice(ssKeySet.str()))
+            pcursor->Next();
     } else {
-        ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash));
+        if (start > 0 && end > 0) {
+            ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, start));
+        } else {
+            ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash));
+        }
+        pcursor->Seek(ssKeySet.str());
     }
-    pcursor->Seek(ssKeySet.str());
 
+    const size_t nFirst = addressIndex.size();
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
+        if (nLimit > 0 && addressIndex.size() - nFirst >= nLimit) {
+            break;
+        }
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
@@ -400,13 +662,160 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+bool CIndexDB::ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value) {
+    if (!WriteIndexBatch())
+        return false;
+    return Read(make_pair(DB_ADDRESSBALANCEINDEX, CAddressIndexIteratorKey(type, addressHash)), value);
+}
+
+bool CIndexDB::UpgradeIndexKeys() {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    const char chLegacy[] = {DB_ADDRESSINDEX_V0, DB_ADDRESSUNSPENTINDEX_V0, DB_SPENTINDEX_V0};
+
     CLevelDBBatch batch;
-    batch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
-    return WriteBatch(batch);
+    size_t nBatchEntries = 0;
+    size_t nMoved = 0;
+    for (unsigned int i = 0; i < sizeof(chLegacy); i++) {
+        pcursor->Seek(leveldb::Slice(&chLegacy[i], 1));
+        while (pcursor->Valid()) {
+            boost::this_thread::interruption_point();
+            leveldb::Slice slKey = pcursor->key();
+            if (slKey.size() == 0 || slKey[0] != chLegacy[i])
+                break;
+            try {
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType == DB_ADDRESSINDEX_V0) {
+                    CAddressIndexKey key;
+                    key.type = ser_readdata8(ssKey);
+                    ssKey >> key.hashBytes;
+                    key.blockHeight = ser_readdata32be(ssKey);
+                    key.txindex = ser_readdata32be(ssKey);
+                    ssKey >> key.txhash;
+                    key.index = ser_readdata32(ssKey);
+                    key.spending = ser_readdata8(ssKey);
+                    CAmount nValue;
+                    ssValue >> nValue;
+                    batch.Write(make_pair(DB_ADDRESSINDEX, key), nValue);
+                } else if (chType == DB_ADDRESSUNSPENTINDEX_V0) {
+                    CAddressUnspentKey key;
+                    key.type = ser_readdata8(ssKey);
+                    ssKey >> key.hashBytes;
+                    ssKey >> key.txhash;
+                    key.index = ser_readdata32(ssKey);
+                    CAddressUnspentValue value;
+                    ssValue >> value;
+                    batch.Write(make_pair(DB_ADDRESSUNSPENTINDEX, key), value);
+                } else {
+                    CSpentIndexKey key;
+                    ssKey >> key.txid;
+                    key.outputIndex = ser_readdata32(ssKey);
+                    CSpentIndexValue value;
+                    ssValue >> value;
+                    batch.Write(make_pair(DB_SPENTINDEX, key), value);
+                }
+                batch.Erase(CFlatData((char*)slKey.data(), (char*)slKey.data() + slKey.size()));
+            } catch (const std::exception& e) {
+                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            }
+            nMoved++;
+            if (++nBatchEntries >= 10000) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatchEntries = 0;
+            }
+            pcursor->Next();
+        }
+    }
+
+    if (nMoved > 0)
+        LogPrintf("%s: moved %u index entries to the compact key format\n", __func__, nMoved);
+    return WriteBatch(batch, true);
+}
+
+bool CIndexDB::BuildAddressBalanceIndex() {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey());
+    pcursor->Seek(ssKeySet.str());
+
+    // Address index keys are sorted by address, so the deltas of one address
+    // are contiguous and can be summed up without keeping them in memory.
+    CLevelDBBatch batch;
+    size_t nBatchEntries = 0;
+    size_t nAddresses = 0;
+    CAddressIndexIteratorKey current;
+    CAddressBalanceValue value;
+
+    while (true) {
+        boost::this_thread::interruption_point();
+        bool fValid = false;
+        CAddressIndexKey indexKey;
+        CAmount nValue = 0;
+        if (pcursor->Valid()) {
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType == DB_ADDRESSINDEX) {
+                    ssKey >> indexKey;
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                    ssValue >> nValue;
+                    fValid = true;
+                }
+            } catch (const std::exception& e) {
+                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+
+        if (!value.IsNull() && (!fValid || indexKey.type != current.type || indexKey.hashBytes != current.hashBytes)) {
+            batch.Write(make_pair(DB_ADDRESSBALANCEINDEX, current), value);
+            nAddresses++;
+            if (++nBatchEntries >= 10000) {
+                if (!WriteBatch(batch))
+                    return false;
+                batch.Clear();
+                nBatchEntries = 0;
+            }
+            value.SetNull();
+        }
+
+        if (!fValid)
+            break;
+
+        if (value.IsNull()) {
+            current = CAddressIndexIteratorKey(indexKey.type, indexKey.hashBytes);
+            value = CAddressBalanceValue(0, 0, 0);
+        }
+        value.balance += nValue;
+        if (nValue > 0)
+            value.received += nValue;
+        value.blockHeight = std::max(value.blockHeight, indexKey.blockHeight);
+
+        pcursor->Next();
+    }
+
+    LogPrintf("%s: built balances for %u addresses\n", __func__, nAddresses);
+    return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+bool CIndexDB::WriteTimestampIndex(const CTimestampIndexKey &timestampIndex) {
+    LOCK(cs_indexBatch);
+    indexBatch.Write(make_pair(DB_TIMESTAMPINDEX, timestampIndex), 0);
+    return true;
+}
+
+bool CIndexDB::ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &hashes) {
+
+    if (!WriteIndexBatch())
+        return false;
 
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
 
@@ -444,13 +853,23 @@ bool CBlockTreeDB::ReadTimestampIndex(const unsigned int &high, const unsigned i
     return true;
 }
 
-bool CBlockTreeDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
-    CLevelDBBatch batch;
-    batch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
-    return WriteBatch(batch);
+bool CIndexDB::WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts) {
+    LOCK(cs_indexBatch);
+    indexBatch.Write(make_pair(DB_BLOCKHASHINDEX, blockhashIndex), logicalts);
+    mapBatchTimestamps[blockhashIndex.blockHash] = logicalts.ltimestamp;
+    return true;
 }
 
-bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+bool CIndexDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &ltimestamp) {
+
+    {
+        LOCK(cs_indexBatch);
+        std::map<uint256, unsigned int>::const_iterator it = mapBatchTimestamps.find(hash);
+        if (it != mapBatchTimestamps.end()) {
+            ltimestamp = it->second;
+            return true;
+        }
+    }
 
     CTimestampBlockIndexValue(lts);
     if (!Read(std::make_pair(DB_BLOCKHASHINDEX, hash), lts))
@@ -460,19 +879,30 @@ bool CBlockTreeDB::ReadTimestampBlockIndex(const uint256 &hash, unsigned int &lt
     return true;
 }
 
-bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
-    return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
+bool CIndexDB::WriteIndexBuildState(unsigned int nIndexes, const uint256 &hash) {
+    LOCK(cs_indexBatch);
+    indexBatch.Write(DB_INDEX_BUILD_STATE, std::make_pair(nIndexes, hash));
+    return true;
 }
 
-bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
-    char ch;
-    if (!Read(std::make_pair(DB_FLAG, name), ch))
+bool CIndexDB::ReadIndexBuildState(unsigned int &nIndexes, uint256 &hash) {
+    if (!WriteIndexBatch())
         return false;
-    fValue = ch == '1';
+    std::pair<unsigned int, uint256> state;
+    if (!Read(DB_INDEX_BUILD_STATE, state))
+        return false;
+    nIndexes = state.first;
+    hash = state.second;
+    return true;
+}
+
+bool CIndexDB::EraseIndexBuildState() {
+    LOCK(cs_indexBatch);
+    indexBatch.Erase(DB_INDEX_BUILD_STATE);
     return true;
 }
 
-bool CBlockTreeDB::blockOnchainActive(const uint256 &hash) {
+bool CIndexDB::blockOnchainActive(const uint256 &hash) {
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
     if (!chainActive.Contains(pblockindex)) {
@@ -482,59 +912,52 @@ bool CBlockTreeDB::blockOnchainActive(const uint256 &hash) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
-{
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+bool CIndexDB::WriteBestIndexedBlock(const uint256 &hash) {
+    LOCK(cs_indexBatch);
+    indexBatch.Write(DB_BEST_INDEXED_BLOCK, hash);
+    return true;
+}
 
-    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair(DB_BLOCK_INDEX, uint256());
-    pcursor->Seek(ssKeySet.str());
+bool CIndexDB::ReadBestIndexedBlock(uint256 &hash) {
+    if (!WriteIndexBatch())
+        return false;
+    return Read(DB_BEST_INDEXED_BLOCK, hash);
+}
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == DB_BLOCK_INDEX) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
+bool CIndexDB::WriteIndexBatch(bool fSync) {
+    LOCK(cs_indexBatch);
+    if (fHoldIndexBatch)
+        return true;
+    if (indexBatch.SizeEstimate() == 0 && !fSync)
+        return true;
+    LogPrint("coindb", "Committing %u bytes of index updates to index database...\n", (unsigned int)indexBatch.SizeEstimate());
+    if (!WriteBatch(indexBatch, fSync))
+        return false;
+    indexBatch.Clear();
+    mapBatchBalances.clear();
+    mapBatchTimestamps.clear();
+    return true;
+}
 
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashAnchor     = diskindex.hashAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashReserved   = diskindex.hashReserved;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-																   
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
+size_t CIndexDB::GetIndexBatchSize() {
+    LOCK(cs_indexBatch);
+    return indexBatch.SizeEstimate();
+}
 
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
+void CIndexDB::HoldIndexBatch(bool fHold) {
+    LOCK(cs_indexBatch);
+    fHoldIndexBatch = fHold;
+}
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
-            }
-        } catch (const std::exception& e) {
-            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-        }
-    }
+bool CIndexDB::WriteFlag(const std::string &name, bool fValue) {
+    return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
+}
 
+bool CIndexDB::ReadFlag(const std::string &name, bool &fValue) {
+    char ch;
+    if (!Read(std::make_pair(DB_FLAG, name), ch))
+        return false;
+    fValue = ch == '1';
     return true;
 }
+
@@ -7,8 +7,10 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
 #include "coins.h"
 #include "dbwrapper.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -37,6 +39,8 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -indexdbcache default, as a fraction of -dbcache
+static const int nIndexDbCacheFraction = 4;
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -61,7 +65,15 @@ public:
     bool GetStats(CCoinsStats &stats) const;
 };
 
-/** Access to the block database (blocks/index/) */
+/**
+ * Access to the block database (blocks/index/)
+ *
+ * Updates to the transaction index are queued in memory and coalesced across
+ * blocks, and only written to the database by WriteIndexBatch() (called from
+ * FlushStateToDisk) or before the index is read. While blocks are being
+ * disconnected the updates are held back until the chainstate is flushed, and
+ * reads see the index as of the last write.
+ */
 class CBlockTreeDB : public CLevelDBWrapper
 {
 public:
@@ -69,6 +81,12 @@ public:
 private:
     CBlockTreeDB(const CBlockTreeDB&);
     void operator=(const CBlockTreeDB&);
+
+    CCriticalSection cs_indexBatch;
+    //! Transaction index updates not written to the database yet
+    CLevelDBBatch indexBatch;
+    //! Keep indexBatch in memory until the chainstate has been flushed
+    bool fHoldIndexBatch;
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
@@ -77,8 +95,47 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool WriteBestIndexedBlock(const uint256 &hash);
+    bool ReadBestIndexedBlock(uint256 &hash);
+    bool WriteIndexBatch(bool fSync = false);
+    size_t GetIndexBatchSize();
+    void HoldIndexBatch(bool fHold);
+    bool WriteFlag(const std::string &name, bool fValue);
+    bool ReadFlag(const std::string &name, bool &fValue);
+    bool LoadBlockIndexGuts();
+};
+
+/**
+ * Access to the address, spent and timestamp index database (indexes/)
+ *
+ * These indexes have their own database, cache and write buffer so that
+ * compacting them does not stall block index writes. Updates are queued in
+ * memory like those to the transaction index.
+ */
+class CIndexDB : public CLevelDBWrapper
+{
+public:
+    CIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool compression = true, int maxOpenFiles = 1000);
+private:
+    CIndexDB(const CIndexDB&);
+    void operator=(const CIndexDB&);
+
+    CCriticalSection cs_indexBatch;
+    //! Index updates not written to the database yet
+    CLevelDBBatch indexBatch;
+    //! Keep indexBatch in memory until the chainstate has been flushed
+    bool fHoldIndexBatch;
+    //! Address balances and logical timestamps in indexBatch, for reads that must see them
+    std::map<std::pair<unsigned int, uint160>, CAddressBalanceValue> mapBatchBalances;
+    std::map<uint256, unsigned int> mapBatchTimestamps;
+public:
+    //! Move index entries written by versions that kept them in the block tree database
+    bool MoveFromBlockTree(CBlockTreeDB &blocktree);
     bool ReadSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
     bool UpdateSpentIndex(const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> >&vect);
+    //! Write address and spent index entries directly, bypassing indexBatch and the balance index
+    bool WriteIndexEntries(const std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
+                           const std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > &spentIndex);
     bool UpdateAddressUnspentIndex(const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue > >&vect);
     bool ReadAddressUnspentIndex(uint160 addressHash, int type,
                                  std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vect);
@@ -86,15 +143,28 @@ public:
     bool EraseAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect);
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> > &addressIndex,
-                          int start = 0, int end = 0);
+                          int start = 0, int end = 0,
+                          const CAddressIndexKey *pkeyAfter = NULL, size_t nLimit = 0);
+    bool ReadAddressBalance(uint160 addressHash, int type, CAddressBalanceValue &value);
+    bool BuildAddressBalanceIndex();
+    bool UpgradeIndexKeys();
     bool WriteTimestampIndex(const CTimestampIndexKey &timestampIndex);
     bool ReadTimestampIndex(const unsigned int &high, const unsigned int &low, const bool fActiveOnly, std::vector<std::pair<uint256, unsigned int> > &vect);
     bool WriteTimestampBlockIndex(const CTimestampBlockIndexKey &blockhashIndex, const CTimestampBlockIndexValue &logicalts);
-    bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);				   
+    bool ReadTimestampBlockIndex(const uint256 &hash, unsigned int &logicalTS);
+    bool WriteIndexBuildState(unsigned int nIndexes, const uint256 &hash);
+    bool ReadIndexBuildState(unsigned int &nIndexes, uint256 &hash);
+    bool EraseIndexBuildState();
+    bool WriteBestIndexedBlock(const uint256 &hash);
+    bool ReadBestIndexedBlock(uint256 &hash);
+    bool WriteIndexBatch(bool fSync = false);
+    size_t GetIndexBatchSize();
+    void HoldIndexBatch(bool fHold);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
-    bool LoadBlockIndexGuts();
     bool blockOnchainActive(const uint256 &hash);
+private:
+    void BatchUpdateAddressBalance(CLevelDBBatch &batch, const std::vector<std::pair<CAddressIndexKey, CAmount> > &vect, bool fUndo);
 };
 
 #endif // BITCOIN_TXDB_H
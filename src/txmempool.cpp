@@ -11,6 +11,7 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "policy/fees.h"
+#include "random.h"
 #include "streams.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -19,8 +20,12 @@
 
 using namespace std;
 
+CMempoolAddressHasher::CMempoolAddressHasher() : salt(GetRandHash()) {}
+
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false)
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false),
+    nFeeDelta(0), nCountWithAncestors(1), nSizeWithAncestors(0), nModFeesWithAncestors(0),
+    nCountWithDescendants(1), nSizeWithDescendants(0), nModFeesWithDescendants(0)
 {
     nHeight = MEMPOOL_HEIGHT;
 }
@@ -29,11 +34,18 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
-    hadNoDependencies(poolHasNoInputsOf)
+    hadNoDependencies(poolHasNoInputsOf), nFeeDelta(0)
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
     nUsageSize = RecursiveDynamicUsage(tx);
+
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = nFee;
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = nFee;
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -50,14 +62,43 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount newFeeDelta)
+{
+    nModFeesWithAncestors += newFeeDelta - nFeeDelta;
+    nModFeesWithDescendants += newFeeDelta - nFeeDelta;
+    nFeeDelta = newFeeDelta;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifyCount, int64_t modifySize, CAmount modifyFee)
+{
+    nCountWithAncestors += modifyCount;
+    nSizeWithAncestors += modifySize;
+    nModFeesWithAncestors += modifyFee;
+    assert(int64_t(nCountWithAncestors) > 0);
+    assert(int64_t(nSizeWithAncestors) >= 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifyCount, int64_t modifySize, CAmount modifyFee)
+{
+    nCountWithDescendants += modifyCount;
+    nSizeWithDescendants += modifySize;
+    nModFeesWithDescendants += modifyFee;
+    assert(int64_t(nCountWithDescendants) > 0);
+    assert(int64_t(nSizeWithDescendants) >= 0);
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0)
+    nTransactionsUpdated(0), cachedInnerUsage(0), minReasonableRelayFee(_minRelayFee)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
     // of transactions in the pool
     fSanityCheck = false;
 
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
+
     minerPolicyEstimator = new CBlockPolicyEstimator(_minRelayFee);
 }
 
@@ -92,14 +133,210 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(txiter entry, setEntries &setAncestors) const
+{
+    setEntries parents = GetMemPoolParents(entry);
+    while (!parents.empty()) {
+        txiter stageit = *parents.begin();
+        parents.erase(parents.begin());
+        setAncestors.insert(stageit);
+        BOOST_FOREACH(const txiter &parentit, GetMemPoolParents(stageit)) {
+            if (!setAncestors.count(parentit))
+                parents.insert(parentit);
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entry, setEntries &setDescendants) const
+{
+    setEntries stage;
+    if (!setDescendants.count(entry))
+        stage.insert(entry);
+    while (!stage.empty()) {
+        txiter stageit = *stage.begin();
+        stage.erase(stage.begin());
+        setDescendants.insert(stageit);
+        BOOST_FOREACH(const txiter &childit, GetMemPoolChildren(stageit)) {
+            if (!setDescendants.count(childit))
+                stage.insert(childit);
+        }
+    }
+}
+
+void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
+{
+    setEntries &parents = mapLinks[entry].parents;
+    if (add && parents.insert(parent).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(parents);
+    else if (!add && parents.erase(parent))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(parents);
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    setEntries &children = mapLinks[entry].children;
+    if (add && children.insert(child).second)
+        cachedInnerUsage += memusage::IncrementalDynamicUsage(children);
+    else if (!add && children.erase(child))
+        cachedInnerUsage -= memusage::IncrementalDynamicUsage(children);
+}
+
+void CTxMemPool::RecalculateAncestorState(txiter it)
+{
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(it, setAncestors);
+    int64_t nCount = 1;
+    int64_t nSize = it->GetTxSize();
+    CAmount nModFees = it->GetModifiedFee();
+    BOOST_FOREACH(const txiter &ancestorit, setAncestors) {
+        nCount++;
+        nSize += ancestorit->GetTxSize();
+        nModFees += ancestorit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_ancestor_state(nCount - it->GetCountWithAncestors(),
+                                           nSize - it->GetSizeWithAncestors(),
+                                           nModFees - it->GetModFeesWithAncestors()));
+}
+
+void CTxMemPool::RecalculateDescendantState(txiter it)
+{
+    setEntries setDescendants;
+    CalculateDescendants(it, setDescendants);
+    int64_t nCount = 0;
+    int64_t nSize = 0;
+    CAmount nModFees = 0;
+    BOOST_FOREACH(const txiter &descendantit, setDescendants) {
+        nCount++;
+        nSize += descendantit->GetTxSize();
+        nModFees += descendantit->GetModifiedFee();
+    }
+    mapTx.modify(it, update_descendant_state(nCount - it->GetCountWithDescendants(),
+                                             nSize - it->GetSizeWithDescendants(),
+                                             nModFees - it->GetModFeesWithDescendants()));
+}
+
+void CTxMemPool::UpdateForAdd(txiter it)
+{
+    const CTransaction& tx = it->GetTx();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+        txiter parentit = mapTx.find(txin.prevout.hash);
+        if (parentit != mapTx.end()) {
+            UpdateParent(it, parentit, true);
+            UpdateChild(parentit, it, true);
+        }
+    }
+
+    // Transactions returning to the pool from a disconnected block can
+    // already have children in it
+    bool fHasChildren = false;
+    for (unsigned int i = 0; i < tx.vout.size(); i++) {
+        std::map<COutPoint, CInPoint>::const_iterator nextit = mapNextTx.find(COutPoint(tx.GetHash(), i));
+        if (nextit == mapNextTx.end())
+            continue;
+        txiter childit = mapTx.find(nextit->second.ptx->GetHash());
+        assert(childit != mapTx.end());
+        UpdateChild(it, childit, true);
+        UpdateParent(childit, it, true);
+        fHasChildren = true;
+    }
+
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(it, setAncestors);
+    if (!fHasChildren) {
+        // The new entry is the only descendant its ancestors gain
+        BOOST_FOREACH(const txiter &ancestorit, setAncestors)
+            mapTx.modify(ancestorit, update_descendant_state(1, it->GetTxSize(), it->GetModifiedFee()));
+        RecalculateAncestorState(it);
+    } else {
+        // Its ancestors gain all its descendants, and its descendants all
+        // its ancestors, so recount them
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(const txiter &descendantit, setDescendants)
+            RecalculateAncestorState(descendantit);
+        RecalculateDescendantState(it);
+        BOOST_FOREACH(const txiter &ancestorit, setAncestors)
+            RecalculateDescendantState(ancestorit);
+    }
+}
+
+void CTxMemPool::UpdateForRemove(const setEntries &setRemove)
+{
+    // The aggregates are updated against the links before any of them go.
+    // An entry removed from the middle of a chain can cut its descendants
+    // off from its ancestors; those are recomputed once it is unlinked.
+    setEntries setRecalculate;
+    BOOST_FOREACH(const txiter &removeit, setRemove) {
+        int64_t nSize = removeit->GetTxSize();
+        CAmount nModFee = removeit->GetModifiedFee();
+        setEntries setAncestors, setOutsideAncestors;
+        CalculateMemPoolAncestors(removeit, setAncestors);
+        BOOST_FOREACH(const txiter &ancestorit, setAncestors) {
+            if (!setRemove.count(ancestorit)) {
+                mapTx.modify(ancestorit, update_descendant_state(-1, -nSize, -nModFee));
+                setOutsideAncestors.insert(ancestorit);
+            }
+        }
+        setEntries setDescendants, setOutsideDescendants;
+        CalculateDescendants(removeit, setDescendants);
+        BOOST_FOREACH(const txiter &descendantit, setDescendants) {
+            if (!setRemove.count(descendantit)) {
+                mapTx.modify(descendantit, update_ancestor_state(-1, -nSize, -nModFee));
+                setOutsideDescendants.insert(descendantit);
+            }
+        }
+        if (!setOutsideAncestors.empty() && !setOutsideDescendants.empty()) {
+            setRecalculate.insert(setOutsideAncestors.begin(), setOutsideAncestors.end());
+            setRecalculate.insert(setOutsideDescendants.begin(), setOutsideDescendants.end());
+        }
+    }
+    BOOST_FOREACH(const txiter &removeit, setRemove) {
+        const TxLinks &links = mapLinks[removeit];
+        BOOST_FOREACH(const txiter &parentit, links.parents)
+            UpdateChild(parentit, removeit, false);
+        BOOST_FOREACH(const txiter &childit, links.children)
+            UpdateParent(childit, removeit, false);
+    }
+    BOOST_FOREACH(const txiter &it, setRecalculate) {
+        RecalculateAncestorState(it);
+        RecalculateDescendantState(it);
+    }
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx[hash] = entry;
-    const CTransaction& tx = mapTx[hash].GetTx();
+    std::pair<txiter, bool> ret = mapTx.insert(entry);
+    if (!ret.second)
+        return false;
+    txiter newit = ret.first;
+    mapLinks.insert(make_pair(newit, TxLinks()));
+
+    // Update the fee of a transaction prioritised before it entered the pool
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second != 0)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    const CTransaction& tx = newit->GetTx();
     for (unsigned int i = 0; i < tx.vin.size(); i++)
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
     BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
@@ -107,6 +344,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
             mapNullifiers[nf] = &tx;
         }
     }
+    UpdateForAdd(newit);
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     cachedInnerUsage += entry.DynamicMemoryUsage();
@@ -119,70 +358,100 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry &entry, const CCoinsViewC
 {
     LOCK(cs);
     const CTransaction& tx = entry.GetTx();
-    std::vector<CMempoolAddressDeltaKey> inserted;
+    std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > deltas;
 
     uint256 txhash = tx.GetHash();
     for (unsigned int j = 0; j < tx.vin.size(); j++) {
         const CTxIn input = tx.vin[j];
         const CTxOut &prevout = view.GetOutputFor(input);
-        if (prevout.scriptPubKey.IsPayToScriptHash()) {
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, j, 1);
-            CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-            vector<unsigned char> hashBytes(prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23);
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, j, 1);
+        int addressType;
+        uint160 hashBytes;
+        if (GetScriptAddressIndex(prevout.scriptPubKey, addressType, hashBytes)) {
+            CMempoolAddressDeltaKey key(addressType, hashBytes, txhash, j, 1);
             CMempoolAddressDelta delta(entry.GetTime(), prevout.nValue * -1, input.prevout.hash, input.prevout.n);
-            mapAddress.insert(make_pair(key, delta));
-            inserted.push_back(key);
+            deltas.push_back(make_pair(key, delta));
+        }
+    }
+
+    for (unsigned int js = 0; js < tx.vjoinsplit.size(); js++) {
+        const JSDescription &joinsplit = tx.vjoinsplit[js];
+        if (joinsplit.vpub_old > 0) {
+            CMempoolAddressDeltaKey key(ADDRESSINDEX_SPROUT, uint160(), txhash, js, 0);
+            deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), joinsplit.vpub_old)));
+        }
+        if (joinsplit.vpub_new > 0) {
+            CMempoolAddressDeltaKey key(ADDRESSINDEX_SPROUT, uint160(), txhash, js, 1);
+            deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), joinsplit.vpub_new * -1)));
         }
     }
 
     for (unsigned int k = 0; k < tx.vout.size(); k++) {
         const CTxOut &out = tx.vout[k];
-        if (out.scriptPubKey.IsPayToScriptHash()) {
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+2, out.scriptPubKey.begin()+22);
-            CMempoolAddressDeltaKey key(2, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
-        } else if (out.scriptPubKey.IsPayToPublicKeyHash()) {
-            vector<unsigned char> hashBytes(out.scriptPubKey.begin()+3, out.scriptPubKey.begin()+23);
-            std::pair<addressDeltaMap::iterator,bool> ret;
-            CMempoolAddressDeltaKey key(1, uint160(hashBytes), txhash, k, 0);
-            mapAddress.insert(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
-            inserted.push_back(key);
+        int addressType;
+        uint160 hashBytes;
+        if (GetScriptAddressIndex(out.scriptPubKey, addressType, hashBytes)) {
+            CMempoolAddressDeltaKey key(addressType, hashBytes, txhash, k, 0);
+            deltas.push_back(make_pair(key, CMempoolAddressDelta(entry.GetTime(), out.nValue)));
         }
     }
 
-    mapAddressInserted.insert(make_pair(txhash, inserted));
+    {
+        LOCK(cs_addressIndex);
+        std::vector<std::pair<std::pair<int, uint160>, size_t> > &inserted = mapAddressInserted[txhash];
+        for (std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> >::const_iterator it = deltas.begin(); it != deltas.end(); it++) {
+            std::pair<int, uint160> address(it->first.type, it->first.addressBytes);
+            addressDeltaBucket &bucket = mapAddress[address];
+            inserted.push_back(make_pair(address, bucket.size()));
+            bucket.push_back(*it);
+        }
+        cachedIndexUsage += memusage::DynamicUsage(inserted) + inserted.size() * sizeof(addressDeltaBucket::value_type);
+    }
 }
 
 bool CTxMemPool::getAddressIndex(std::vector<std::pair<uint160, int> > &addresses,
                                  std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > &results)
 {
-    LOCK(cs);
+    LOCK(cs_addressIndex);
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
-        addressDeltaMap::iterator ait = mapAddress.lower_bound(CMempoolAddressDeltaKey((*it).second, (*it).first));
-        while (ait != mapAddress.end() && (*ait).first.addressBytes == (*it).first && (*ait).first.type == (*it).second) {
-            results.push_back(*ait);
-            ait++;
-        }
+        addressDeltaMap::const_iterator ait = mapAddress.find(std::make_pair((*it).second, (*it).first));
+        if (ait != mapAddress.end())
+            results.insert(results.end(), ait->second.begin(), ait->second.end());
     }
     return true;
 }
 
 bool CTxMemPool::removeAddressIndex(const uint256 txhash)
 {
-    LOCK(cs);
+    LOCK2(cs, cs_addressIndex);
     addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
 
     if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = (*it).second;
-        for (std::vector<CMempoolAddressDeltaKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
-            mapAddress.erase(*mit);
+        // Entries are removed by moving the last entry of the bucket into
+        // their place, which means updating the position recorded for it.
+        // Positions are re-read on every iteration since that entry can
+        // belong to this transaction too.
+        std::vector<std::pair<std::pair<int, uint160>, size_t> > &inserted = (*it).second;
+        for (size_t i = 0; i < inserted.size(); i++) {
+            addressDeltaMap::iterator ait = mapAddress.find(inserted[i].first);
+            assert(ait != mapAddress.end());
+            addressDeltaBucket &bucket = ait->second;
+            size_t nPos = inserted[i].second;
+            size_t nLast = bucket.size() - 1;
+            if (nPos != nLast) {
+                bucket[nPos] = bucket[nLast];
+                std::vector<std::pair<std::pair<int, uint160>, size_t> > &moved = mapAddressInserted[bucket[nPos].first.txhash];
+                for (size_t j = 0; j < moved.size(); j++) {
+                    if (moved[j].first == inserted[i].first && moved[j].second == nLast) {
+                        moved[j].second = nPos;
+                        break;
+                    }
+                }
+            }
+            bucket.pop_back();
+            if (bucket.empty())
+                mapAddress.erase(ait);
         }
+        cachedIndexUsage -= memusage::DynamicUsage(inserted) + inserted.size() * sizeof(addressDeltaBucket::value_type);
         mapAddressInserted.erase(it);
     }
 
@@ -202,17 +471,7 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
         const CTxOut &prevout = view.GetOutputFor(input);
         uint160 addressHash;
         int addressType;
-
-        if (prevout.scriptPubKey.IsPayToScriptHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+2, prevout.scriptPubKey.begin()+22));
-            addressType = 2;
-        } else if (prevout.scriptPubKey.IsPayToPublicKeyHash()) {
-            addressHash = uint160(vector<unsigned char> (prevout.scriptPubKey.begin()+3, prevout.scriptPubKey.begin()+23));
-            addressType = 1;
-        } else {
-            addressHash.SetNull();
-            addressType = 0;
-        }
+        GetScriptAddressIndex(prevout.scriptPubKey, addressType, addressHash);
 
         CSpentIndexKey key = CSpentIndexKey(input.prevout.hash, input.prevout.n);
         CSpentIndexValue value = CSpentIndexValue(txhash, j, -1, prevout.nValue, addressType, addressHash);
@@ -222,7 +481,9 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry &entry, const CCoinsViewCac
 
     }
 
-    mapSpentInserted.insert(make_pair(txhash, inserted));
+    std::pair<mapSpentIndexInserted::iterator, bool> ret = mapSpentInserted.insert(make_pair(txhash, inserted));
+    if (ret.second)
+        cachedIndexUsage += memusage::DynamicUsage(ret.first->second);
 }
 
 bool CTxMemPool::getSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value)
@@ -248,19 +509,45 @@ bool CTxMemPool::removeSpentIndex(const uint256 txhash)
         for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
             mapSpent.erase(*mit);
         }
+        cachedIndexUsage -= memusage::DynamicUsage((*it).second);
         mapSpentInserted.erase(it);
     }
 
     return true;
 }
+void CTxMemPool::removeUnchecked(txiter it)
+{
+    const uint256 hash = it->GetTx().GetHash();
+    const CTransaction& tx = it->GetTx();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapNextTx.erase(txin.prevout);
+    BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+        BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
+            mapNullifiers.erase(nf);
+        }
+    }
+
+    totalTxSize -= it->GetTxSize();
+    cachedInnerUsage -= it->DynamicMemoryUsage();
+    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
+    mapLinks.erase(it);
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+    minerPolicyEstimator->removeTx(hash);
+    removeAddressIndex(hash);
+    removeSpentIndex(hash);
+}
+
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        setEntries txToRemove;
+        txiter origit = mapTx.find(origTx.GetHash());
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
@@ -269,53 +556,41 @@ void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& rem
                 std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
-                BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
-                    mapNullifiers.erase(nf);
-                }
-            }
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            cachedInnerUsage -= mapTx[hash].DynamicMemoryUsage();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-            minerPolicyEstimator->removeTx(hash);
-            removeAddressIndex(hash);
-            removeSpentIndex(hash);
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            BOOST_FOREACH(const txiter &it, txToRemove)
+                CalculateDescendants(it, setAllRemoves);
+        } else {
+            setAllRemoves.swap(txToRemove);
         }
+        BOOST_FOREACH(const txiter &it, setAllRemoves)
+            removed.push_back(it->GetTx());
+        RemoveStaged(setAllRemoves);
     }
 }
 
+void CTxMemPool::RemoveStaged(setEntries &stage)
+{
+    AssertLockHeld(cs);
+    UpdateForRemove(stage);
+    BOOST_FOREACH(const txiter &it, stage)
+        removeUnchecked(it);
+}
+
 void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned int nMemPoolHeight)
 {
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -342,8 +617,8 @@ void CTxMemPool::removeWithAnchor(const uint256 &invalidRoot)
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
 
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
             if (joinsplit.anchor == invalidRoot) {
                 transactionsToRemove.push_back(tx);
@@ -398,9 +673,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator i = mapTx.find(tx.GetHash());
+        if (i != mapTx.end())
+            entries.push_back(*i);
     }
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
@@ -411,15 +686,24 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 void CTxMemPool::clear()
 {
-    LOCK(cs);
+    LOCK2(cs, cs_addressIndex);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
+    mapNullifiers.clear();
+    mapAddress.clear();
+    mapAddressInserted.clear();
+    mapSpent.clear();
+    mapSpentInserted.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
+    cachedIndexUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -437,19 +721,25 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        innerUsage += it->second.DynamicMemoryUsage();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
+        txlinksMap::const_iterator linksiter = mapLinks.find(it);
+        assert(linksiter != mapLinks.end());
+        const TxLinks &links = linksiter->second;
+        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -461,6 +751,33 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == links.parents);
+
+        // Check the ancestor and descendant aggregates against the links
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        uint64_t nCountCheck = setAncestors.size() + 1;
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(const txiter &ancestorit, setAncestors) {
+            nSizeCheck += ancestorit->GetTxSize();
+            nFeesCheck += ancestorit->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == nCountCheck);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH(const txiter &descendantit, setDescendants) {
+            nSizeCheck += descendantit->GetTxSize();
+            nFeesCheck += descendantit->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
 
         boost::unordered_map<uint256, ZCIncrementalMerkleTree, CCoinsKeyHasher> intermediates;
 
@@ -485,7 +802,7 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             intermediates.insert(std::make_pair(tree.root(), tree));
         }
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             assert(ContextualCheckInputs(tx, state, mempoolDuplicate, false, 0, false, Params().GetConsensus(), NULL));
@@ -509,9 +826,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
@@ -519,9 +836,9 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     for (std::map<uint256, const CTransaction*>::const_iterator it = mapNullifiers.begin(); it != mapNullifiers.end(); it++) {
         uint256 hash = it->second->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second);
     }
 
@@ -535,16 +852,16 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -601,6 +918,20 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        txiter it = mapTx.find(hash);
+        if (it != mapTx.end()) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+            // Update the packages the transaction is part of
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(it, setAncestors);
+            BOOST_FOREACH(const txiter &ancestorit, setAncestors)
+                mapTx.modify(ancestorit, update_descendant_state(0, 0, nFeeDelta));
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH(const txiter &descendantit, setDescendants)
+                mapTx.modify(descendantit, update_ancestor_state(0, 0, nFeeDelta));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -656,6 +987,70 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) const {
 }
 
 size_t CTxMemPool::DynamicMemoryUsage() const {
+    LOCK2(cs, cs_addressIndex);
+    // Estimate the overhead of mapTx to be 12 pointers per entry: three for each of its four indexes
+    size_t nIndexUsage = memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) +
+                         memusage::DynamicUsage(mapSpent) + memusage::DynamicUsage(mapSpentInserted) + cachedIndexUsage;
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapNullifiers) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + cachedInnerUsage + nIndexUsage;
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        // Decay faster while the mempool is well below its limit
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minReasonableRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minReasonableRelayFee);
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit) {
     LOCK(cs);
-    return memusage::DynamicUsage(mapTx) + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + cachedInnerUsage;
+
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+
+        // The new minimum fee is the fee rate of the removed package plus the
+        // minimum relay fee, so that the same package cannot come straight
+        // back in before a block has been found
+        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        removed = CFeeRate(removed.GetFeePerK() + minReasonableRelayFee.GetFeePerK());
+        trackPackageRemoved(removed);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+        // The descendants go with it; RemoveStaged also drops the nullifiers
+        // of evicted JoinSplit transactions from mapNullifiers
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        RemoveStaged(stage);
+    }
+
+    if (maxFeeRateRemoved > CFeeRate(0))
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
 }
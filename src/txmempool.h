@@ -8,6 +8,12 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/identity.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "addressindex.h"
 #include "spentindex.h"
@@ -35,6 +41,14 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Each entry also caches the count, size and modified fees (fees plus the
+ * delta set by prioritisetransaction) of itself together with all its
+ * in-mempool ancestors, and of itself together with all its in-mempool
+ * descendants. CTxMemPool keeps these up to date as transactions enter and
+ * leave the pool, so block assembly can pick transactions by the fee rate
+ * of their whole package and eviction can drop the cheapest packages
+ * without walking the pool.
  */
 class CTxMemPoolEntry
 {
@@ -48,6 +62,17 @@ private:
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
+    CAmount nFeeDelta; //! Fee delta set by prioritisetransaction
+
+    // Information about this entry and its in-mempool ancestors
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+
+    // Information about this entry and its in-mempool descendants
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
 
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
@@ -58,15 +83,174 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + nFeeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     bool WasClearAtEntry() const { return hadNoDependencies; }
     size_t DynamicMemoryUsage() const { return nUsageSize; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+
+    /** Set the prioritisetransaction fee delta, adjusting the aggregates that include this entry */
+    void UpdateFeeDelta(CAmount newFeeDelta);
+    /** Add the given count, size and modified fees to the ancestor aggregates */
+    void UpdateAncestorState(int64_t modifyCount, int64_t modifySize, CAmount modifyFee);
+    /** Add the given count, size and modified fees to the descendant aggregates */
+    void UpdateDescendantState(int64_t modifyCount, int64_t modifySize, CAmount modifyFee);
+};
+
+// Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifyCount, int64_t _modifySize, CAmount _modifyFee) :
+        modifyCount(_modifyCount), modifySize(_modifySize), modifyFee(_modifyFee)
+    { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateAncestorState(modifyCount, modifySize, modifyFee); }
+
+private:
+    int64_t modifyCount;
+    int64_t modifySize;
+    CAmount modifyFee;
+};
+
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifyCount, int64_t _modifySize, CAmount _modifyFee) :
+        modifyCount(_modifyCount), modifySize(_modifySize), modifyFee(_modifyFee)
+    { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateDescendantState(modifyCount, modifySize, modifyFee); }
+
+private:
+    int64_t modifyCount;
+    int64_t modifySize;
+    CAmount modifyFee;
+};
+
+// extracts a transaction hash from CTxMemPoolEntry
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort an entry by the higher of its own fee rate and the fee rate of its
+ * package with its descendants, so the first entries are the ones whose
+ * eviction loses the least fees. Among equals, newer entries sort first and
+ * are evicted before older ones.
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        bool fUseADescendants = UseDescendantScore(a);
+        bool fUseBDescendants = UseDescendantScore(b);
+
+        double aModFee = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        double bModFee = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aModFee * bSize;
+        double f2 = aSize * bModFee;
+
+        if (f1 == f2) {
+            return a.GetTime() > b.GetTime();
+        }
+        return f1 < f2;
+    }
+
+    // Whether the fee rate of the package with descendants is higher than the entry's own
+    bool UseDescendantScore(const CTxMemPoolEntry& a) const
+    {
+        double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
 };
 
+/** Sort an entry by its entry time, oldest first */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/**
+ * Sort an entry by the fee rate of its package with its ancestors, highest
+ * first, which is the order block assembly considers them in.
+ */
+class CompareTxMemPoolEntryByAncestorFee
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        double aFees = a.GetModFeesWithAncestors();
+        double aSize = a.GetSizeWithAncestors();
+        double bFees = b.GetModFeesWithAncestors();
+        double bSize = b.GetSizeWithAncestors();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        double f1 = aFees * bSize;
+        double f2 = aSize * bFees;
+
+        if (f1 == f2) {
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 > f2;
+    }
+};
+
+// Multi_index tag names
+struct descendant_score {};
+struct entry_time {};
+struct ancestor_score {};
+
 class CBlockPolicyEstimator;
 
+/** Salted hasher for the (type, hash) address keys of the mempool address index */
+class CMempoolAddressHasher
+{
+private:
+    uint256 salt;
+
+public:
+    CMempoolAddressHasher();
+
+    size_t operator()(const std::pair<int, uint160>& key) const {
+        uint256 hash;
+        memcpy(hash.begin(), key.second.begin(), key.second.size());
+        hash.begin()[key.second.size()] = key.first;
+        return hash.GetHash(salt);
+    }
+};
+
 /** An inpoint - a combination of a transaction and an index n into its vin */
 class CInPoint
 {
@@ -101,15 +285,92 @@ private:
     uint64_t totalTxSize = 0; //! sum of all mempool tx' byte sizes
     uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
 
+    CFeeRate minReasonableRelayFee;
+
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+
+    void trackPackageRemoved(const CFeeRate& rate);
+
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; // public only for testing
+
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::ordered_unique<mempoolentry_txid>,
+            // sorted by fee rate with descendants
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by fee rate with ancestors
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<ancestor_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByAncestorFee
+            >
+        >
+    > indexed_transaction_set;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
 private:
-    typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
+    //! In-mempool parents and children of each entry
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    void UpdateParent(txiter entry, txiter parent, bool add);
+    void UpdateChild(txiter entry, txiter child, bool add);
+    /** Link an entry to its in-mempool parents and children and update the aggregates it is part of */
+    void UpdateForAdd(txiter it);
+    /** Update the aggregates of the ancestors and descendants outside setRemove of the entries in setRemove, then unlink them */
+    void UpdateForRemove(const setEntries &setRemove);
+    /** Recompute the ancestor aggregates of an entry from its ancestor set */
+    void RecalculateAncestorState(txiter it);
+    /** Recompute the descendant aggregates of an entry from its descendant set */
+    void RecalculateDescendantState(txiter it);
+    /** Remove an entry whose links and aggregates UpdateForRemove already took care of */
+    void removeUnchecked(txiter it);
+    /** Remove a set of entries that includes the in-mempool descendants of each of them */
+    void RemoveStaged(setEntries &stage);
+
+    /**
+     * The address index has its own lock, taken after cs by writers, so
+     * getAddressIndex() only waits for the short updates of the index itself
+     * and not for whole mempool operations on the validation thread.
+     */
+    mutable CCriticalSection cs_addressIndex;
+
+    //! Deltas of each address, stored contiguously in one bucket per address
+    typedef std::vector<std::pair<CMempoolAddressDeltaKey, CMempoolAddressDelta> > addressDeltaBucket;
+    typedef boost::unordered_map<std::pair<int, uint160>, addressDeltaBucket, CMempoolAddressHasher> addressDeltaMap;
     addressDeltaMap mapAddress;
 
-    typedef std::map<uint256, std::vector<CMempoolAddressDeltaKey> > addressDeltaMapInserted;
+    //! Bucket and position in that bucket of each delta of a transaction
+    typedef std::map<uint256, std::vector<std::pair<std::pair<int, uint160>, size_t> > > addressDeltaMapInserted;
     addressDeltaMapInserted mapAddressInserted;
 
     typedef std::map<CSpentIndexKey, CSpentIndexValue, CSpentIndexKeyCompare> mapSpentIndex;
@@ -118,6 +379,9 @@ private:
     typedef std::map<uint256, std::vector<CSpentIndexKey> > mapSpentIndexInserted;
     mapSpentIndexInserted mapSpentInserted;
 
+    //! Dynamic memory usage of the vectors held by the index maps above (NOT the maps themselves), guarded by cs
+    uint64_t cachedIndexUsage = 0;
+
 public:
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, const CTransaction*> mapNullifiers;
@@ -153,6 +417,15 @@ public:
                         std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
+
+    /** The in-mempool parents of an entry */
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    /** The in-mempool children of an entry */
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+    /** Add all the in-mempool ancestors of an entry, not including itself, to setAncestors */
+    void CalculateMemPoolAncestors(txiter entry, setEntries &setAncestors) const;
+    /** Add an entry and all its in-mempool descendants to setDescendants */
+    void CalculateDescendants(txiter entry, setEntries &setDescendants) const;
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
@@ -167,6 +440,19 @@ public:
     void ApplyDeltas(const uint256 hash, double &dPriorityDelta, CAmount &nFeeDelta);
     void ClearPrioritisation(const uint256 hash);
 
+    /**
+     * The minimum fee rate to get into the mempool, which may itself not be
+     * enough for larger-sized transactions. It is raised to the fee rate of
+     * the packages TrimToSize evicts and decays once blocks come in.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
+    /**
+     * Evict the packages with the lowest fee rate with descendants until the
+     * dynamic memory usage of the mempool is at most sizelimit.
+     */
+    void TrimToSize(size_t sizelimit);
+
     unsigned long size()
     {
         LOCK(cs);
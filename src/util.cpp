@@ -714,6 +714,21 @@ int RaiseFileDescriptorLimit(int nMinFD) {
 #endif
 }
 
+/**
+ * this function asks the OS to start reading a particular range of a file into the page cache
+ * it is advisory, and returns without waiting for the read
+ */
+void FileReadAhead(FILE *file, unsigned int offset, unsigned int length) {
+#if defined(__linux__)
+    posix_fadvise(fileno(file), offset, length, POSIX_FADV_WILLNEED);
+#elif defined(MAC_OSX)
+    struct radvisory radv;
+    radv.ra_offset = offset;
+    radv.ra_count = length;
+    fcntl(fileno(file), F_RDADVISE, &radv);
+#endif
+}
+
 /**
  * this function tries to make a particular range of a file allocated (corresponding to disk space)
  * it is advisory, and the range specified in the arguments will never contain live data
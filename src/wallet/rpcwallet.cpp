@@ -2733,6 +2733,24 @@ UniValue zc_sample_joinsplit(const UniValue& params, bool fHelp)
     return HexStr(ss.begin(), ss.end());
 }
 
+/**
+ * Run a benchmark with cs_main released, for benchmarks that wait for other
+ * threads (workers, the network threads) which take cs_main themselves.
+ */
+template <typename Benchmark>
+static double RunBenchmarkWithoutMainLock(Benchmark benchmark)
+{
+    LEAVE_CRITICAL_SECTION(cs_main);
+    try {
+        double time = benchmark();
+        ENTER_CRITICAL_SECTION(cs_main);
+        return time;
+    } catch (...) {
+        ENTER_CRITICAL_SECTION(cs_main);
+        throw;
+    }
+}
+
 UniValue zc_benchmark(const UniValue& params, bool fHelp)
 {
     if (!EnsureWalletIsAvailable(fHelp)) {
@@ -2771,7 +2789,7 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
 
     JSDescription samplejoinsplit;
 
-    if (benchmarktype == "verifyjoinsplit") {
+    if (benchmarktype == "verifyjoinsplit" || benchmarktype == "verifyblockjoinsplits") {
         CDataStream ss(ParseHexV(params[2].get_str(), "js"), SER_NETWORK, PROTOCOL_VERSION);
         ss >> samplejoinsplit;
     }
@@ -2793,6 +2811,9 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             }
         } else if (benchmarktype == "verifyjoinsplit") {
             sample_times.push_back(benchmark_verify_joinsplit(samplejoinsplit));
+        } else if (benchmarktype == "verifyblockjoinsplits") {
+            int nThreads = params[3].get_int();
+            sample_times.push_back(benchmark_verify_joinsplits_threaded(samplejoinsplit, 50, nThreads));
 #ifdef ENABLE_MINING
         } else if (benchmarktype == "solveequihash") {
             if (params.size() < 3) {
@@ -2831,6 +2852,34 @@ UniValue zc_benchmark(const UniValue& params, bool fHelp)
             sample_times.push_back(benchmark_loadwallet());
         } else if (benchmarktype == "listunspent") {
             sample_times.push_back(benchmark_listunspent());
+        } else if (benchmarktype == "sigcache") {
+            int nThreads = params[2].get_int();
+            sample_times.push_back(benchmark_sigcache_threaded(nThreads));
+        } else if (benchmarktype == "buildindexes") {
+            int nThreads = params[2].get_int();
+            sample_times.push_back(benchmark_build_indexes(nThreads));
+        } else if (benchmarktype == "readblocks") {
+            sample_times.push_back(benchmark_read_blocks(true));
+        } else if (benchmarktype == "readblockstrusted") {
+            sample_times.push_back(benchmark_read_blocks(false));
+        } else if (benchmarktype == "indexlookupmisses") {
+            sample_times.push_back(benchmark_index_lookup_misses(10000));
+        } else if (benchmarktype == "coinsmap") {
+            sample_times.push_back(benchmark_coins_map(1000));
+        } else if (benchmarktype == "coinsunorderedmap") {
+            sample_times.push_back(benchmark_coins_unordered_map(1000));
+        } else if (benchmarktype == "merkleroot") {
+            sample_times.push_back(benchmark_merkle_root(10000));
+        } else if (benchmarktype == "acceptflood") {
+            int nThreads = params[2].get_int();
+            sample_times.push_back(RunBenchmarkWithoutMainLock([&]() {
+                return benchmark_accept_flood(5000, nThreads);
+            }));
+        } else if (benchmarktype == "peerconnections") {
+            int nPeers = params[2].get_int();
+            sample_times.push_back(RunBenchmarkWithoutMainLock([&]() {
+                return benchmark_peer_connections(nPeers);
+            }));
         } else {
             throw JSONRPCError(RPC_TYPE_ERROR, "Invalid benchmarktype");
         }
@@ -1,9 +1,15 @@
+#include <atomic>
 #include <cstdio>
 #include <future>
 #include <map>
 #include <thread>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
 
 #include "coins.h"
 #include "util.h"
@@ -11,13 +17,20 @@
 #include "primitives/transaction.h"
 #include "base58.h"
 #include "crypto/equihash.h"
+#include "hash.h"
 #include "chain.h"
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "net.h"
+#include "netbase.h"
 #include "pow.h"
+#include "protocol.h"
+#include "random.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "script/sign.h"
 #include "sodium.h"
 #include "streams.h"
@@ -160,6 +173,34 @@ double benchmark_verify_joinsplit(const JSDescription &joinsplit)
     return timer_stop(tv_start);
 }
 
+double benchmark_verify_joinsplits_threaded(const JSDescription &joinsplit, size_t nJoinSplits, int nThreads)
+{
+    // Verify a block's worth of proofs through a proof check queue, as
+    // ConnectBlock does, with the calling thread as one of the workers
+    CCheckQueue<CProofCheck> queue(1);
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads - 1; i++)
+        threads.create_thread(boost::bind(&CCheckQueue<CProofCheck>::Thread, &queue));
+
+    uint256 pubKeyHash;
+    std::vector<CProofCheck> vChecks;
+    for (size_t i = 0; i < nJoinSplits; i++)
+        vChecks.push_back(CProofCheck(joinsplit, pubKeyHash, false));
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    {
+        CCheckQueueControl<CProofCheck> control(&queue);
+        control.Add(vChecks);
+        assert(control.Wait());
+    }
+    double duration = timer_stop(tv_start);
+
+    threads.interrupt_all();
+    threads.join_all();
+    return duration;
+}
+
 #ifdef ENABLE_MINING
 double benchmark_solve_equihash()
 {
@@ -463,6 +504,41 @@ double benchmark_loadwallet()
     return res;
 }
 
+double benchmark_sigcache_threaded(int nThreads)
+{
+    // Verify signatures once to put them in the signature cache
+    CTransaction txTo;
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    std::vector<uint256> vHashes(1000);
+    std::vector<std::vector<unsigned char> > vSigs(vHashes.size());
+    CachingTransactionSignatureChecker checker(&txTo, 0, true);
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        vHashes[i] = GetRandHash();
+        assert(key.Sign(vHashes[i], vSigs[i]));
+        assert(checker.VerifySignature(vSigs[i], pubkey, vHashes[i]));
+    }
+
+    // Look them up from nThreads threads at once, as the script check
+    // threads do when connecting a block
+    struct timeval tv_start;
+    timer_start(tv_start);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nThreads; t++) {
+        threads.emplace_back([&]() {
+            CachingTransactionSignatureChecker threadChecker(&txTo, 0, false);
+            for (int n = 0; n < 100; n++)
+                for (size_t i = 0; i < vHashes.size(); i++)
+                    assert(threadChecker.VerifySignature(vSigs[i], pubkey, vHashes[i]));
+        });
+    }
+    for (auto it = threads.begin(); it != threads.end(); it++) {
+        it->join();
+    }
+    return timer_stop(tv_start);
+}
+
 double benchmark_listunspent()
 {
     UniValue params(UniValue::VARR);
@@ -471,3 +547,371 @@ double benchmark_listunspent()
     auto unspent = listunspent(params, false);
     return timer_stop(tv_start);
 }
+
+double benchmark_build_indexes(int nThreads)
+{
+    std::vector<const CBlockIndex*> vBlocks;
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* pindex = chainActive[1]; pindex != NULL; pindex = chainActive.Next(pindex))
+            vBlocks.push_back(pindex);
+    }
+
+    // Build into a scratch in-memory database, leaving the node's indexes alone
+    CIndexDB db(1 << 23, true, true);
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    assert(BuildIndexesParallel(db, vBlocks, INDEX_BUILD_ADDRESS | INDEX_BUILD_SPENT, nThreads));
+    return timer_stop(tv_start);
+}
+
+double benchmark_read_blocks(bool fCheckPoW)
+{
+    std::vector<std::pair<CDiskBlockPos, uint256> > vBlocks;
+    {
+        LOCK(cs_main);
+        for (const CBlockIndex* pindex = chainActive.Genesis(); pindex != NULL; pindex = chainActive.Next(pindex)) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA)
+                vBlocks.push_back(std::make_pair(pindex->GetBlockPos(), pindex->GetBlockHash()));
+        }
+    }
+
+    // Read every block of the active chain the way a wallet rescan does,
+    // either re-verifying each Equihash solution or trusting the block index
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (size_t i = 0; i < vBlocks.size(); i++) {
+        CBlock block;
+        if (fCheckPoW) {
+            assert(ReadBlockFromDisk(block, vBlocks[i].first));
+            assert(block.GetHash() == vBlocks[i].second);
+        } else {
+            assert(ReadBlockFromDisk(block, vBlocks[i].first, vBlocks[i].second));
+        }
+    }
+    auto duration = timer_stop(tv_start);
+    LogPrint("bench", "%s: %u blocks\n", __func__, vBlocks.size());
+    return duration;
+}
+
+double benchmark_index_lookup_misses(size_t nAddrs)
+{
+    // Populate a scratch in-memory database with nAddrs addresses that
+    // each have a few received outputs, one of them spent
+    CIndexDB db(1 << 23, true, true);
+    size_t nKeyBytes = 0;
+    for (size_t i = 0; i < nAddrs; i++) {
+        uint160 addressHash;
+        GetRandBytes(addressHash.begin(), addressHash.size());
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentIndex;
+        std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+        for (int n = 0; n < 4; n++) {
+            uint256 txid = GetRandHash();
+            int nHeight = i + n;
+            addressIndex.push_back(std::make_pair(CAddressIndexKey(1, addressHash, nHeight, n, txid, n, false), 1000));
+            unspentIndex.push_back(std::make_pair(CAddressUnspentKey(1, addressHash, txid, n), CAddressUnspentValue(1000, CScript(), nHeight)));
+            spentIndex.push_back(std::make_pair(CSpentIndexKey(txid, n), CSpentIndexValue(GetRandHash(), 0, nHeight + 1, 1000, 1, addressHash)));
+            nKeyBytes += ::GetSerializeSize(addressIndex.back().first, SER_DISK, CLIENT_VERSION) +
+                         ::GetSerializeSize(unspentIndex.back().first, SER_DISK, CLIENT_VERSION) +
+                         ::GetSerializeSize(spentIndex.back().first, SER_DISK, CLIENT_VERSION);
+        }
+        assert(db.WriteAddressIndex(addressIndex));
+        assert(db.UpdateAddressUnspentIndex(unspentIndex));
+        assert(db.UpdateSpentIndex(spentIndex));
+    }
+    assert(db.WriteIndexBatch(true));
+    LogPrint("bench", "%s: %u index keys, %u key bytes\n", __func__, nAddrs * 12, nKeyBytes);
+
+    // Look up as many addresses and outpoints that were never indexed
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (size_t i = 0; i < nAddrs; i++) {
+        uint160 addressHash;
+        GetRandBytes(addressHash.begin(), addressHash.size());
+        std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > unspentIndex;
+        assert(db.ReadAddressIndex(addressHash, 1, addressIndex) && addressIndex.empty());
+        assert(db.ReadAddressUnspentIndex(addressHash, 1, unspentIndex) && unspentIndex.empty());
+        CSpentIndexKey key(GetRandHash(), 0);
+        CSpentIndexValue value;
+        assert(!db.ReadSpentIndex(key, value));
+    }
+    return timer_stop(tv_start);
+}
+
+template<typename Map>
+static double benchmark_coins_map_workload(size_t nBlocks)
+{
+    // Replay the coins cache traffic of connecting nBlocks blocks of 1000
+    // transactions with one input and two pay-to-pubkey-hash outputs each,
+    // flushing every 100 blocks as a large -dbcache would
+    CTxOut txout(1000, CScript() << OP_DUP << OP_HASH160 << ToByteVector(uint160()) << OP_EQUALVERIFY << OP_CHECKSIG);
+    std::vector<uint256> vTxids;
+    for (size_t i = 0; i < nBlocks * 1000; i++)
+        vTxids.push_back(GetRandHash());
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    Map map;
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        // Spend an output of an earlier transaction of the same flush
+        size_t nFirst = i - i % 100000;
+        if (i > nFirst) {
+            typename Map::iterator it = map.find(vTxids[nFirst + GetRand(i - nFirst)]);
+            if (it != map.end()) {
+                it->second.coins.Spend(it->second.coins.vout.size() - 1);
+                if (it->second.coins.IsPruned())
+                    map.erase(it);
+            }
+        }
+        CCoinsCacheEntry& entry = map[vTxids[i]];
+        entry.coins.vout.assign(2, txout);
+        entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+        if (i % 100000 == 99999)
+            map.clear();
+    }
+    map.clear();
+    return timer_stop(tv_start);
+}
+
+double benchmark_coins_map(size_t nBlocks)
+{
+    return benchmark_coins_map_workload<CCoinsMap>(nBlocks);
+}
+
+double benchmark_coins_unordered_map(size_t nBlocks)
+{
+    return benchmark_coins_map_workload<boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> >(nBlocks);
+}
+
+double benchmark_merkle_root(size_t nTxs)
+{
+    CBlock block;
+    for (size_t i = 0; i < nTxs; i++) {
+        CMutableTransaction mtx;
+        mtx.nLockTime = i;
+        block.vtx.push_back(CTransaction(mtx));
+    }
+
+    struct timeval tv_start;
+    timer_start(tv_start);
+    for (int n = 0; n < 100; n++) {
+        bool fMutated;
+        block.BuildMerkleTree(&fMutated);
+        assert(!fMutated);
+    }
+    return timer_stop(tv_start);
+}
+
+double benchmark_accept_flood(size_t nTxs, int nThreads)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+    // Fund each transaction from its own fake coin, kept in a view on top of
+    // the chain tip that is never flushed and only passed to the checks
+    CCoinsViewCache* pcoinsTipCurrent;
+    {
+        LOCK(cs_main);
+        pcoinsTipCurrent = pcoinsTip;
+    }
+    CCoinsViewCache viewFake(pcoinsTipCurrent);
+    CTxMemPool pool(::minRelayTxFee);
+    std::vector<CTransaction> vTxs;
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < nTxs; i++) {
+            CMutableTransaction mtxFund;
+            mtxFund.nLockTime = i;
+            mtxFund.vout.resize(1);
+            mtxFund.vout[0].nValue = COIN;
+            mtxFund.vout[0].scriptPubKey = scriptPubKey;
+            CTransaction txFund(mtxFund);
+            viewFake.ModifyCoins(txFund.GetHash())->FromTx(txFund, chainActive.Height());
+
+            CMutableTransaction mtx;
+            mtx.vin.resize(1);
+            mtx.vin[0].prevout = COutPoint(txFund.GetHash(), 0);
+            mtx.vout.resize(1);
+            mtx.vout[0].nValue = COIN - 100000;
+            mtx.vout[0].scriptPubKey = scriptPubKey;
+            assert(SignSignature(keystore, txFund, mtx, 0, SIGHASH_ALL));
+            vTxs.push_back(CTransaction(mtx));
+        }
+    }
+
+    // Accept them as a flood of relayed transactions: with nThreads threads
+    // checking them without cs_main first, or with nThreads = 0 entirely
+    // under cs_main as the message handler used to
+    struct timeval tv_start;
+    timer_start(tv_start);
+    if (nThreads == 0) {
+        for (size_t i = 0; i < vTxs.size(); i++) {
+            CValidationState state;
+            LOCK(cs_main);
+            assert(AcceptToMemoryPool(pool, state, vTxs[i], true, NULL, false, false, &viewFake));
+        }
+    } else {
+        std::atomic<size_t> nNext(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nThreads; t++) {
+            threads.emplace_back([&]() {
+                for (size_t i = nNext++; i < vTxs.size(); i = nNext++) {
+                    CValidationState state;
+                    assert(PreCheckTransaction(pool, state, vTxs[i], &viewFake));
+                    LOCK(cs_main);
+                    assert(AcceptToMemoryPool(pool, state, vTxs[i], true, NULL, false, false, &viewFake));
+                }
+            });
+        }
+        for (auto it = threads.begin(); it != threads.end(); it++) {
+            it->join();
+        }
+    }
+    auto duration = timer_stop(tv_start);
+    assert(pool.size() == nTxs);
+
+    return duration;
+}
+
+#ifdef __linux__
+namespace {
+
+void PeerBenchmarkSend(SOCKET hSocket, const char* pszCommand, const CDataStream& payload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, payload.size());
+    uint256 hash = Hash(payload.begin(), payload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ssSend(SER_NETWORK, PROTOCOL_VERSION);
+    ssSend << hdr << payload;
+    if (send(hSocket, &ssSend[0], ssSend.size(), MSG_NOSIGNAL) != (ssize_t)ssSend.size())
+        throw std::runtime_error(strprintf("Failed to send %s to the node", pszCommand));
+}
+
+void PeerBenchmarkDrain(const std::vector<SOCKET>& vSockets)
+{
+    char pchBuf[0x10000];
+    BOOST_FOREACH(SOCKET hSocket, vSockets) {
+        while (recv(hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT) > 0) {}
+    }
+}
+
+int PeerBenchmarkCountInbound(bool fConnected)
+{
+    LOCK(cs_vNodes);
+    int nInbound = 0;
+    BOOST_FOREACH(CNode* pnode, vNodes) {
+        if (pnode->fInbound && (!fConnected || pnode->fSuccessfullyConnected))
+            nInbound++;
+    }
+    return nInbound;
+}
+
+double CpuSeconds(int who)
+{
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 0.000001;
+}
+
+// CPU time used by every thread of the node except the calling one
+double NodeCpuSeconds()
+{
+    return CpuSeconds(RUSAGE_SELF) - CpuSeconds(RUSAGE_THREAD);
+}
+
+}
+#endif
+
+double benchmark_peer_connections(int nPeers)
+{
+#ifndef __linux__
+    throw std::runtime_error("The peerconnections benchmark is only supported on Linux");
+#else
+    if (!fListen)
+        throw std::runtime_error("The node is not accepting connections (-listen=0)");
+
+    // Both ends of every loopback connection live in this process
+    if (RaiseFileDescriptorLimit(nMaxConnections + nPeers + 1000) < nMaxConnections + nPeers + 100)
+        throw std::runtime_error("Not enough file descriptors available for the requested peers");
+
+    int nInboundBefore = PeerBenchmarkCountInbound(false);
+    CService addrNode("127.0.0.1", GetListenPort());
+    CAddress addrMe(CService("127.0.0.1", 0));
+    std::vector<SOCKET> vSockets;
+
+    auto closeSockets = [&]() {
+        BOOST_FOREACH(SOCKET& hSocket, vSockets)
+            CloseSocket(hSocket);
+        vSockets.clear();
+    };
+
+    try {
+        // Connect the peers and complete the version handshake with each
+        for (int i = 0; i < nPeers; i++) {
+            SOCKET hSocket;
+            if (!ConnectSocket(addrNode, hSocket, nConnectTimeout))
+                throw std::runtime_error(strprintf("Failed to connect peer %d to %s", i, addrNode.ToString()));
+            vSockets.push_back(hSocket);
+
+            uint64_t nNonce = GetRand(std::numeric_limits<uint64_t>::max());
+            CDataStream ssVersion(SER_NETWORK, INIT_PROTO_VERSION);
+            ssVersion << PROTOCOL_VERSION << (uint64_t)0 << GetTime() << CAddress(addrNode) << addrMe
+                      << nNonce << std::string("/bench/") << 0 << true;
+            PeerBenchmarkSend(hSocket, "version", ssVersion);
+            PeerBenchmarkSend(hSocket, "verack", CDataStream(SER_NETWORK, PROTOCOL_VERSION));
+
+            if (i % 100 == 99)
+                PeerBenchmarkDrain(vSockets);
+        }
+
+        int64_t nDeadline = GetTime() + 60;
+        while (PeerBenchmarkCountInbound(true) < nInboundBefore + nPeers) {
+            if (GetTime() > nDeadline)
+                throw std::runtime_error(strprintf(
+                    "Only %d of %d peers were accepted; raise -maxconnections",
+                    PeerBenchmarkCountInbound(true) - nInboundBefore, nPeers));
+            PeerBenchmarkDrain(vSockets);
+            MilliSleep(10);
+        }
+
+        // Keep every connection lightly busy with a ping per second, and
+        // measure the CPU the node spends servicing them
+        static const int nSeconds = 10;
+        double nCpuStart = NodeCpuSeconds();
+        for (int nSecond = 0; nSecond < nSeconds; nSecond++) {
+            int64_t nNext = GetTimeMillis() + 1000;
+            BOOST_FOREACH(SOCKET hSocket, vSockets) {
+                CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+                ssPing << GetRand(std::numeric_limits<uint64_t>::max());
+                PeerBenchmarkSend(hSocket, "ping", ssPing);
+            }
+            while (GetTimeMillis() < nNext) {
+                PeerBenchmarkDrain(vSockets);
+                MilliSleep(10);
+            }
+        }
+        double nCpu = NodeCpuSeconds() - nCpuStart;
+        LogPrint("bench", "%s: %d peers used %.3fs node CPU over %ds\n", __func__, nPeers, nCpu, nSeconds);
+
+        closeSockets();
+
+        // Let the node notice the disconnections before the next sample
+        nDeadline = GetTime() + 60;
+        while (PeerBenchmarkCountInbound(false) > nInboundBefore && GetTime() <= nDeadline)
+            MilliSleep(10);
+
+        return nCpu / nPeers;
+    } catch (...) {
+        closeSockets();
+        throw;
+    }
+#endif
+}
@@ -11,6 +11,7 @@ extern std::vector<double> benchmark_create_joinsplit_threaded(int nThreads);
 extern double benchmark_solve_equihash();
 extern std::vector<double> benchmark_solve_equihash_threaded(int nThreads);
 extern double benchmark_verify_joinsplit(const JSDescription &joinsplit);
+extern double benchmark_verify_joinsplits_threaded(const JSDescription &joinsplit, size_t nJoinSplits, int nThreads);
 extern double benchmark_verify_equihash();
 extern double benchmark_large_tx();
 extern double benchmark_try_decrypt_notes(size_t nAddrs);
@@ -19,5 +20,14 @@ extern double benchmark_connectblock_slow();
 extern double benchmark_sendtoaddress(CAmount amount);
 extern double benchmark_loadwallet();
 extern double benchmark_listunspent();
+extern double benchmark_sigcache_threaded(int nThreads);
+extern double benchmark_build_indexes(int nThreads);
+extern double benchmark_read_blocks(bool fCheckPoW);
+extern double benchmark_index_lookup_misses(size_t nAddrs);
+extern double benchmark_coins_map(size_t nBlocks);
+extern double benchmark_coins_unordered_map(size_t nBlocks);
+extern double benchmark_merkle_root(size_t nTxs);
+extern double benchmark_accept_flood(size_t nTxs, int nThreads);
+extern double benchmark_peer_connections(int nPeers);
 
 #endif
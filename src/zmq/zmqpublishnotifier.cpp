@@ -164,8 +164,10 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
 {
     LogPrint("zmq", "zmq: Publish rawblock %s\n", pindex->GetBlockHash().GetHex());
 
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    {
+    // The new tip is normally still in memory
+    std::shared_ptr<const CDataStream> pssRecent = GetRecentBlockBytes(pindex->GetBlockHash());
+    CDataStream ssRead(SER_NETWORK, PROTOCOL_VERSION);
+    if (!pssRecent) {
         LOCK(cs_main);
         CBlock block;
         if(!ReadBlockFromDisk(block, pindex))
@@ -174,8 +176,9 @@ bool CZMQPublishRawBlockNotifier::NotifyBlock(const CBlockIndex *pindex)
             return false;
         }
 
-        ss << block;
+        ssRead << block;
     }
+    const CDataStream& ss = pssRecent ? *pssRecent : ssRead;
 
     return SendMessage(MSG_RAWBLOCK, &(*ss.begin()), ss.size());
 }